@@ -0,0 +1,91 @@
+/**********************************************************************/
+/*    StockMarket project 2013                                        */
+/*    FeedReader: follows the market data feed of a running          */
+/*    simulation (StockMarket -F name) and prints every message       */
+/**********************************************************************/
+
+// Includes-defines
+#include "StockMarket.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/******************** Main function ********************/
+int main(int argc, char *argv[])
+{
+	/*************************************************************************/
+	/* Starts at the current head of the ring. A message is taken when its  */
+	/* slot holds our position + 1 before and after the copy; a later       */
+	/* position means the writers lapped us, so we skip to the head and     */
+	/* wait for the next snapshots to rebuild the book.                     */
+	/*************************************************************************/
+    
+    const char *name = (argc > 1) ? argv[1] : "/stockmarket";
+    const feedRing *f;
+    const feedSlot *s;
+    feedMsg msg;
+    unsigned long pos, seq;
+    struct stat st;
+    int fd, spins = 0;
+    
+    fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0)
+	{
+        perror(name);
+        return (1);
+    }
+    if (fstat(fd, &st) != 0 || st.st_size < (long) sizeof (feedRing))
+	{
+        fprintf(stderr, "%s: not a market data feed of this build\n", name);
+        return (1);
+    }
+    f = (const feedRing *) mmap(NULL, sizeof (feedRing), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (f == MAP_FAILED || memcmp(f->magic, FEEDMAGIC, 4) != 0
+        || f->msgSize != sizeof (feedMsg) || f->nslots != FEEDSIZE)
+	{
+        fprintf(stderr, "%s: not a market data feed of this build\n", name);
+        return (1);
+    }
+    
+    pos = atomic_load((_Atomic unsigned long *) &f->head);
+    while (1)
+	{
+        s = &f->slot[pos & (FEEDSIZE-1)];
+        seq = atomic_load_explicit((_Atomic unsigned long *) &s->seq, memory_order_acquire);
+        if (seq == pos + 1)
+		{
+            msg = s->msg;
+            atomic_thread_fence(memory_order_acquire);
+            if (atomic_load_explicit((_Atomic unsigned long *) &s->seq, memory_order_relaxed) != pos + 1)
+                continue;
+    
+            // time  symbol  kind  side  price  volume  orders
+            printf("%012ld  %04d  %c  %c  %5.1f  %6d  %4d\n", msg.timestamp, msg.symbol,
+                   msg.kind, msg.side, (float) msg.price/10.0, msg.vol, msg.orders);
+            pos++;
+            spins = 0;
+        }
+        else if (seq > pos + 1 || atomic_load((_Atomic unsigned long *) &f->head) < pos)
+		{
+			// lapped, or the simulation restarted
+            fprintf(stderr, "*** Lost the feed at %lu, resuming at the head\n", pos);
+            fflush(stdout);
+            pos = atomic_load((_Atomic unsigned long *) &f->head);
+        }
+        else if (++spins < SPINCOUNT)
+            cpuRelax();
+        else
+		{
+            // idle, let the output out and back off
+            fflush(stdout);
+            usleep(100);
+        }
+    }
+    return (0);
+}
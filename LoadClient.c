@@ -0,0 +1,315 @@
+/**********************************************************************/
+/*    StockMarket project 2013                                        */
+/*    LoadClient: sends orders to the gateway of a running           */
+/*    simulation (StockMarket -G addr) and measures the round trip   */
+/**********************************************************************/
+
+// Includes-defines
+#include "StockMarket.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define TYPES "MLSTI"	// order types, the order -a sends them in
+
+int  connectTo(const char *addr);
+void sendAll(int fd, const void *data, int len);
+int  takeReports(int fd);
+long nowNanos();
+int  compareLong(const void *a, const void *b);
+
+// Orders in flight and what came back
+long *sentAt, *lat, *ids;	// send time of each order, round trips, engine ids (-1 if refused)
+char *types;	// type of each order
+long acked[5];	// acknowledgements by type, in the order of TYPES
+long done = 0;	// orders acknowledged or rejected
+long fills = 0, filled = 0, canceled = 0, rejected = 0;
+char buf[GWBUFFER];	// reports received, up to the last whole one
+int have = 0;
+
+/******************** Main function ********************/
+int main(int argc, char *argv[])
+{
+	/*************************************************************************/
+	/* Keeps up to a window of new orders in flight, with a cancel of an    */
+	/* order already acknowledged every tenth request, and times each new   */
+	/* order from its send to its acknowledgement. The references are the  */
+	/* order numbers, so each acknowledgement finds its send time. With -a  */
+	/* the new orders go through every type in turn, stops and icebergs too. */
+	/*************************************************************************/
+    
+	/********************************/
+	/* -n orders: new orders sent   */
+	/* -w orders: in flight at once */
+	/* -s symbols: traded           */
+	/* -r seed: random seed         */
+	/* -e: end the order stream     */
+	/*    when done                 */
+	/* -a: every order type         */
+	/********************************/
+    
+    const char *addr = "unix:/tmp/stockmarket";
+    long orders = 100000, window = 64, sent = 0, requests = 0, elapsed, start;
+    int symbols = 1, end = 0, all = 0, opt, fd, n, t;
+    unsigned int seed = 0;
+    gwRequest req[RINGBATCH];
+    
+    while ((opt = getopt(argc, argv, "n:w:s:r:ea")) != -1)
+	{
+        switch (opt)
+		{
+            case 'n': orders = atol(optarg); break;
+            case 'w': window = atol(optarg); break;
+            case 's': symbols = atoi(optarg); break;
+            case 'r': seed = atoi(optarg); break;
+            case 'e': end = 1; break;
+            case 'a': all = 1; break;
+            default :
+                fprintf(stderr, "Usage: %s [-n orders] [-w window] [-s symbols] [-r seed] [-e] [-a] [unix:path|tcp:[host:]port]\n", argv[0]);
+                exit(1);
+        }
+    }
+    if (optind < argc)
+        addr = argv[optind];
+    if (orders < 1 || window < 1 || symbols < 1)
+	{
+        fprintf(stderr, "Expected at least one order, one in flight and one symbol\n");
+        exit(1);
+    }
+    srand(seed);
+    
+    fd = connectTo(addr);
+    if (fd < 0)
+	{
+        perror(addr);
+        exit(1);
+    }
+    sentAt = (long *) malloc (orders * sizeof (long));
+    lat = (long *) malloc (orders * sizeof (long));
+    ids = (long *) malloc (orders * sizeof (long));
+    types = (char *) malloc (orders);
+    
+    memset(req, 0, sizeof (req));
+    start = nowNanos();
+    while (done < orders)
+	{
+		// top the window up, in one write
+        for (n = 0; n < RINGBATCH && sent < orders && sent - done < window; n++)
+		{
+            req[n].length = sizeof (gwRequest);
+            req[n].symbol = rand() % symbols;
+            if (++requests % 10 == 0 && done > 0 && (req[n].id = ids[rand() % done]) >= 0)
+			{
+				// of an order the engine took; a refused one got no id, a new order goes instead
+                req[n].kind = GW_CANCEL;
+                req[n].ref = 0;
+                continue;
+            }
+            req[n].kind = GW_ORDER;
+            req[n].action = (rand() % 2) ? 'B' : 'S';
+            req[n].type = all ? TYPES[sent % 5] : (rand() % 9 < 4) ? 'M' : 'L';
+            req[n].vol = (1 + rand() % 50) * 100;
+            req[n].price = 995 + rand() % 11;
+			// a stop a little away from the price, an iceberg showing part of its shares
+            if (req[n].type == 'S' || req[n].type == 'T')
+                req[n].id = (req[n].action == 'B') ? 1001 + rand() % 10 : 999 - rand() % 10;
+            else if (req[n].type == 'I')
+                req[n].id = (1 + rand() % 5) * 100;
+            else
+                req[n].id = 0;
+            types[sent] = req[n].type;
+            req[n].ref = ++sent;
+            sentAt[sent - 1] = nowNanos();
+        }
+        if (n > 0)
+            sendAll(fd, req, n * sizeof (gwRequest));
+    
+		// then take whatever reports have come
+        if (takeReports(fd) <= 0)
+		{
+            fprintf(stderr, "*** Gateway closed the connection after %ld of %ld orders\n", done, orders);
+            exit(1);
+        }
+    }
+    elapsed = nowNanos() - start;
+    
+	// the simulation closes the connection once it has stopped
+    if (end)
+	{
+        memset(req, 0, sizeof (gwRequest));
+        req[0].length = sizeof (gwRequest);
+        req[0].kind = GW_END;
+        sendAll(fd, req, sizeof (gwRequest));
+        while (takeReports(fd) > 0);
+    }
+    close(fd);
+    
+    qsort(lat, done, sizeof (long), compareLong);
+    printf ("%ld orders, %ld cancels in %.3f s: %.0f orders/s\n", done, requests - sent, elapsed / 1e9, done / (elapsed / 1e9));
+    printf ("%ld fills (%ld shares), %ld canceled, %ld rejected\n", fills, filled, canceled, rejected);
+    printf ("ack round trip (ns): p50 %ld  p99 %ld  p99.9 %ld  max %ld\n",
+            lat[done / 2], lat[(long) (done * 0.99)], lat[(long) (done * 0.999)], lat[done - 1]);
+    if (all)
+	{
+        printf ("acknowledged by type:");
+        for (t = 0; t < 5; t++)
+            printf ("  %c %ld", TYPES[t], acked[t]);
+        printf ("\n");
+    }
+    return (0);
+}
+
+/******************** Connect function ********************/
+int connectTo(const char *addr)
+{
+	// unix:path, or tcp:[host:]port with the host 127.0.0.1 by default
+    struct sockaddr_un un;
+    struct sockaddr_in in;
+    const char *port;
+    char host[64] = "127.0.0.1";
+    int fd, one = 1;
+    
+    if (strncmp(addr, "unix:", 5) == 0 && strlen(addr + 5) < sizeof (un.sun_path))
+	{
+        memset(&un, 0, sizeof (un));
+        un.sun_family = AF_UNIX;
+        strcpy(un.sun_path, addr + 5);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd >= 0 && connect(fd, (struct sockaddr *) &un, sizeof (un)) != 0)
+		{
+            close(fd);
+            return (-1);
+        }
+        return (fd);
+    }
+    if (strncmp(addr, "tcp:", 4) != 0)
+	{
+        errno = EINVAL;
+        return (-1);
+    }
+    port = strrchr(addr, ':') + 1;
+    if (port - addr > 5 && port - addr - 5 < (long) sizeof (host))
+	{
+        memcpy(host, addr + 4, port - addr - 5);
+        host[port - addr - 5] = '\0';
+    }
+    memset(&in, 0, sizeof (in));
+    in.sin_family = AF_INET;
+    in.sin_port = htons(atoi(port));
+    if (inet_pton(AF_INET, host, &in.sin_addr) != 1)
+	{
+        errno = EINVAL;
+        return (-1);
+    }
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr *) &in, sizeof (in)) != 0)
+	{
+        close(fd);
+        return (-1);
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+    return (fd);
+}
+
+/******************** Take reports function ********************/
+int takeReports(int fd)
+{
+	// one read, and every whole report in the buffer; returns what recv did
+    gwReport rep;
+    int i, n;
+    
+    n = recv(fd, buf + have, sizeof (buf) - have, 0);
+    if (n <= 0)
+        return (n);
+    have += n;
+    for (i = 0; have - i >= (int) sizeof (rep); i += rep.length)
+	{
+        memcpy(&rep, buf + i, sizeof (rep));
+        if (rep.length < sizeof (rep))
+		{
+            fprintf(stderr, "*** Bad report length %d\n", rep.length);
+            exit(1);
+        }
+        if (have - i < rep.length)
+            break;
+        switch (rep.kind)
+		{
+            case GW_ACK:
+                lat[done] = nowNanos() - sentAt[rep.ref - 1];
+                ids[done++] = rep.id;
+                acked[strchr(TYPES, types[rep.ref - 1]) - TYPES]++;
+                break;
+            case GW_FILL: fills++; filled += rep.vol; break;
+            case GW_CANCELED: canceled++; break;
+            case GW_REJECT:
+                rejected++;
+				// a new order that was refused is done with too
+                if (rep.ref > 0)
+				{
+                    lat[done] = nowNanos() - sentAt[rep.ref - 1];
+                    ids[done++] = -1;
+                }
+                break;
+        }
+    }
+    memmove(buf, buf + i, have - i);
+    have -= i;
+    return (n);
+}
+
+/******************** Send all function ********************/
+void sendAll(int fd, const void *data, int len)
+{
+	// the reports are taken while the socket is full, or the gateway would drop us
+    struct pollfd p = {fd, POLLIN | POLLOUT, 0};
+    int n;
+    
+    while (len > 0)
+	{
+        if (poll(&p, 1, -1) < 0)
+            continue;
+        if ((p.revents & POLLIN) && takeReports(fd) <= 0)
+		{
+            fprintf(stderr, "*** Gateway closed the connection\n");
+            exit(1);
+        }
+        if (!(p.revents & POLLOUT))
+            continue;
+        n = send(fd, data, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0)
+		{
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            perror("send");
+            exit(1);
+        }
+        data = (const char *) data + n;
+        len -= n;
+    }
+}
+
+/******************** Time function ********************/
+long nowNanos()
+{
+    struct timespec t;
+    
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (t.tv_sec * 1000000000L + t.tv_nsec);
+}
+
+/******************** Sort order function ********************/
+int compareLong(const void *a, const void *b)
+{
+    long x = *(const long *) a, y = *(const long *) b;
+    
+    return ((x > y) - (x < y));
+}
@@ -0,0 +1,119 @@
+/**********************************************************************/
+/*    StockMarket project 2013                                        */
+/*    SnapCheck: checks a snapshot (snapshot.bin) against the order   */
+/*    file of the run that took it (StockMarket -W file -S orders)    */
+/**********************************************************************/
+
+// Includes-defines
+#include "StockMarket.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/******************** Whole file loading function ********************/
+char *fileLoad(const char *path, long *size)
+{
+    FILE *in;
+    char *data;
+    
+    in = fopen(path, "rb");
+    if (in == NULL)
+        return (NULL);
+    fseek(in, 0, SEEK_END);
+    *size = ftell(in);
+    rewind(in);
+    data = (char *) malloc (*size + 1);
+    if (data == NULL || (long) fread(data, 1, *size, in) != *size)
+	{
+        free(data);
+        data = NULL;
+    }
+    fclose(in);
+    return (data);
+}
+
+/******************** Main function ********************/
+int main(int argc, char *argv[])
+{
+	/*************************************************************************/
+	/* Every order of the stream before the snapshot's position was in the   */
+	/* markets when it was taken, so a cancel among them either is still in  */
+	/* a cancel queue of the snapshot or has been carried out: the order it  */
+	/* cancels, if it was still resting then, must not be in the snapshot.   */
+	/* An order caught between two containers would be missing from it, or  */
+	/* be there twice.                                                       */
+	/*************************************************************************/
+    
+    const char *snapPath = (argc > 1) ? argv[1] : "snapshot.bin";
+    const char *orderPath = (argc > 2) ? argv[2] : "orders.bin";
+    const snapshotHeader *hdr;
+    const snapshotMarket *sm;
+    const orderFileHeader *ohdr;
+    const order *rec;
+    char *snap, *orders, *state;
+    long snapSize, orderSize, count, i, resting = 0, pending = 0, checked = 0, bad = 0;
+    int s, j;
+    
+    snap = fileLoad(snapPath, &snapSize);
+    orders = fileLoad(orderPath, &orderSize);
+    if (snap == NULL || orders == NULL)
+	{
+        perror((snap == NULL) ? snapPath : orderPath);
+        return (1);
+    }
+    hdr = (const snapshotHeader *) snap;
+    ohdr = (const orderFileHeader *) orders;
+    if (snapSize < (long) sizeof (*hdr) || memcmp(hdr->magic, SNAPMAGIC, 4) != 0 || hdr->recordSize != sizeof (order)
+        || orderSize < (long) sizeof (*ohdr) || memcmp(ohdr->magic, ORDERMAGIC, 4) != 0 || ohdr->recordSize != sizeof (order))
+	{
+        fprintf(stderr, "%s, %s: not a snapshot and an order file of this build\n", snapPath, orderPath);
+        return (1);
+    }
+    count = (orderSize - sizeof (*ohdr)) / sizeof (order);
+    if (hdr->position < ohdr->offset || ohdr->offset + count < hdr->position)
+	{
+        fprintf(stderr, "%s: orders %ld to %ld, the snapshot was taken after %ld\n", orderPath, ohdr->offset, ohdr->offset + count, hdr->position);
+        return (1);
+    }
+    
+	// 1 for an order resting in the snapshot, 2 for a cancel still queued in it
+    state = (char *) calloc (hdr->nextId + 1, 1);
+    sm = (const snapshotMarket *) (hdr + 1);
+    for (s = 0; s < hdr->nsymbols; s++)
+	{
+        rec = (const order *) (sm + 1);
+        for (j = 0; j < sm->orders; j++)
+		{
+            if (rec[j].id < 0 || rec[j].id >= hdr->nextId || state[rec[j].id] != 0)
+			{
+                printf("Order %ld is in the snapshot twice or was never taken\n", rec[j].id);
+                bad++;
+                continue;
+            }
+            state[rec[j].id] = (rec[j].type == 'C') ? 2 : 1;
+            if (rec[j].type == 'C')
+                pending++;
+            else
+                resting++;
+        }
+        sm = (const snapshotMarket *) (rec + sm->orders);
+    }
+    
+	// the cancels of the orders before the file's offset cannot be checked
+    rec = (const order *) (ohdr + 1);
+    for (i = 0; i < hdr->position - ohdr->offset; i++)
+	{
+        if (rec[i].type != 'C' || state[rec[i].id] == 2)
+            continue;
+        checked++;
+        if (rec[i].oldid >= 0 && rec[i].oldid < hdr->nextId && state[rec[i].oldid] == 1)
+		{
+            printf("Order %ld is in the snapshot, canceled by order %ld before it\n", rec[i].oldid, rec[i].id);
+            bad++;
+        }
+    }
+    
+    printf("Snapshot at order %ld: %ld orders resting, %ld cancels queued, %ld cancels carried out, %ld errors\n",
+           hdr->position, resting, pending, checked, bad);
+    return (bad > 0);
+}
@@ -7,1072 +7,5543 @@
 /**********************************************************************/
 
 // Includes-defines
+#define _GNU_SOURCE
 #include "StockMarket.h"
 #include <stdio.h>
 #include <math.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <time.h>
 #include <sys/time.h>
 #include <string.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/syscall.h>
 
-#define QUEUESIZE 5000
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1	// mbind mode, as in <numaif.h>
+#endif
 
-// Queues to be used
-queue *bm_q;		// buy-market queue
-queue *sm_q;		// sell-market queue
-queue *bl_q;		// buy-limit queue
-queue *sl_q;		// sell-limit queue
-queue *cancel_q;	// cancel queue
+// Books to be used, one per symbol
+market **markets;
+spscRing **shard_q;	// orders routed to each sequencer worker
 
-queue *queueInit (void);
+queue *queueInit (int capacity);
+book  *bookInit (int symbol, char side, int price);
+orderIndex *indexInit (int locked);
 
 
 /******************** Functions ********************/
 
-// For queues-heaps
-void queueAdd(queue *q, order ord);
+// For queues
+int  queueAdd(queue *q, order ord);
 void queueDel(queue *q, order *ord);
 void queueDelete(queue *q);
-void heapInsert(queue *q, order ord);
-void heapDel(queue *q, order *out);
+void queueCancel(queue *q, int n);
+orderHot  *queueTop(queue *q);
+orderCold *queueCold(queue *q);
 
-// For transactions
-void MMtrans(queue *q1, queue *q2);
-void MLtrans(queue *q1, queue *q2);
-void LMtrans(queue *q1, queue *q2);
-void LLtrans(queue *q1, queue *q2);
+// For the order node pools
+void poolInit(orderPool *p);
+int  poolGet(orderPool *p);
+void poolPut(orderPool *p, int n);
+void poolDelete(orderPool *p);
+void poolStore(orderPool *p, int n, const order *in);
+void poolLoad(orderPool *p, int n, order *out);
+poolChunk *chunkAlloc(int node);
+
+// For the incoming ring
+spscRing *spscInit(int park);
+int  spscPush(spscRing *r, const order *ord, int n);
+int  spscPop(spscRing *r, order *out, int max);
+void spscPut(spscRing *r, const order *ord, int n);
+int  spscTake(spscRing *r, order *out, int max);
+mpscRing *mpscInit(int park);
+void mpscPut(mpscRing *r, const order *ord, int n);
+int  mpscPop(mpscRing *r, order *out, int max);
+int  mpscTake(mpscRing *r, order *out, int max);
+int  mpscOffer(mpscRing *r, const order *ord, int n);
+
+// For book sides, the ones with a side argument specialized for it
+int    bookInsert(book *b, order ord);
+void   bookDel(book *b, order *out);
+orderHot  *bookTop(book *b);
+orderCold *bookCold(book *b);
+level *bookLevel(book *b, int price);
+void   bookWiden(book *b, int price);
+void   bookUnlink(book *b, int n);
+void   bookRefill(book *b);
+void   bookShow(market *m, const order *ord);
+SPECIALIZED int  bookInsertSide(book *b, order ord, const char side);
+SPECIALIZED void bookDelSide(book *b, order *out, const char side);
+SPECIALIZED void bookUnlinkSide(book *b, int n, const char side);
+
+// For transactions: side is the side of the order that trades, type1 its type and type2 the other side's
+void BMMtrans(market *m);
+void BMLtrans(market *m);
+void SMMtrans(market *m);
+void SMLtrans(market *m);
+void BLMtrans(market *m);
+void BLLtrans(market *m);
+void SLMtrans(market *m);
+void SLLtrans(market *m);
+SPECIALIZED queue *sideQueue(market *m, const char side);
+SPECIALIZED book  *sideBook(market *m, const char side);
+SPECIALIZED int  tradeReady(market *m, const char side, const char type1, const char type2);
+SPECIALIZED int  sweep(market *m, const char side, const char type1, const char type2);
+void sweepReport(tradeFill *f, int n, long picked);
+void fillTop(market *m, queue *q, book *b, int volume);
+SPECIALIZED void fillTopSide(market *m, queue *q, book *b, int volume, const char side, const char type);
 
 // For cancel
-int  queueSearch(queue *q, long id);
-int  heapSearch(queue *q, long id);
-void queueExtract(queue *q, long i);
-void heapExtract(queue *q, long i);
+void indexAdd(orderIndex *x, long id, queue *q, book *b, int slot);
+int  indexFind(orderIndex *x, long id, indexEntry *out);
+int  indexMove(orderIndex *x, long id, queue *q, book *b, int slot);
+int  indexDel(orderIndex *x, long id);
+int  indexHome(orderIndex *x, long id);
+void indexGrow(orderIndex *x);
+int  orderCancel(market *m, long id);
+void orderUnlink(indexEntry *loc);
+
+// For stop orders
+order stopKeyed(order ord);
+void stopAdd(market *m, order ord);
+int  stopFire(market *m, order ord);
+void stopsFire(market *m, int hi, int lo);
+void stopsLock(market *m);
+void stopsUnlock(market *m);
+int  stopsRoute(market *m);
+void routeStops(market *m, order *group, int k);
+int  routeFired(market *m, const order *ord);
 
 // Thread functions 
-void* Prod(void* q);
+void* Prod(void* g);
 void* Cons(void* q);
-void* BMTry();
-void* SMTry();
-void* BLTry();
-void* SLTry();
-void* CancelTry();
+void* BMTry(void *arg);
+void* SMTry(void *arg);
+void* BLTry(void *arg);
+void* SLTry(void *arg);
+SPECIALIZED void trierRun(market *m, const char side, const char type, void (*first)(market *), void (*second)(market *));
+SPECIALIZED int  trierTry(market *m, const char side, const char type1, const char type2, void (*trans)(market *));
+void* CancelTry(void *arg);
+void* Seq(void *g);
+void* Worker(void *arg);
+
+// For the sequencer
+void seqProcess(market *m, order ord);
+void seqPlace(market *m, order ord);
+int  seqMatch(market *m);
+SPECIALIZED int  seqTry(market *m, const char side, const char type1, const char type2, void (*trans)(market *));
+void seqDispatch(const order *batch, int n);
+void seqPin(int core);
+
+// For the thread placement
+int  placeParse(const char *spec);
+int  cpuNode(int core);
+void roleCreate(pthread_t *t, int role, void *(*fn)(void *), void *arg);
+
+// For the order sources
+int   nextOrders(generator *g, const order **batch, int max);
+FILE *recordOpen(const char *path, long offset);
+orderFile *replayOpen(const char *path, int paced);
+int   replayNext(orderFile *f, const order **batch, int max);
+void  streamTaken(const order *batch, int n);
+void  streamEnded();
+
+// For snapshots
+void snapshotTake();
+int  snapshotWrite(const char *path);
+int  snapshotQueue(int fd, queue *q, char *buf, int *used);
+int  snapshotBook(int fd, book *b, char *buf, int *used);
+int  snapshotPut(int fd, const void *data, int len, char *buf, int *used);
+const snapshotHeader *snapshotOpen(const char *path);
+long snapshotRestore(const snapshotHeader *hdr);
+void marketsLock();
+void marketsUnlock();
+
+// For the call auctions
+void auctionSwitch(char phase);
+void auctionMarket(market *m, char phase);
+int  auctionUncross(market *m);
+int  auctionPrice(market *m, long *demand, long *supply, int lo, int n, long *volume);
+
+// For the journal
+journal *journalInit(const char *path, long interval, long offset);
+void  journalAppend(journal *j, const order *batch, int n);
+int   journalTake(journal *j, order *out, int max, int wait);
+int   journalRoom(journal *j);
+int   journalPending(journal *j);
+void* Journaler(void *arg);
+void  journalClose(journal *j, pthread_t writer);
+
+// For the order gateway
+gateway *gatewayOpen(const char *addr);
+void* Gateway(void *arg);
+void gatewayAccept(gateway *gw);
+void gatewayRead(gateway *gw, int c);
+void gatewayParse(gateway *gw, int c);
+int  gatewayPrice(int symbol, long price);
+void gatewayPush(gateway *gw);
+void gatewayDrain(gateway *gw);
+void gatewayPost(gateway *gw, int c, const gwReport *rep);
+void gatewayFlush(gateway *gw, int c);
+void gatewayEvents(gateway *gw, int c);
+void gatewayDrop(gateway *gw, int c);
+void gatewayClose(gateway *gw, pthread_t thread);
+void gatewayReport(const order *rec, int n);
+void gatewayAck(const order *batch, int n);
+void gatewayFills(const tradeFill *f, int n);
+void gatewayCancel(const order *ord, int found);
+int  incomingOffer(const order *batch, int n);
+
+// For the trade log
+tradeLog *tradeLogInit(const char *path);
+void  tradeLogPut(tradeLog *l, const tradeRecord *rec, int n);
+void* Logger(void *arg);
+void  tradeLogClose(tradeLog *l, pthread_t writer);
+int   writeAll(int fd, const void *data, size_t len);
+
+// For the market data feed
+feedRing *feedOpen(const char *name);
+void feedPut(feedRing *f, feedMsg *msg);
+void feedLevel(book *b, int price, level *l, char kind);
+void feedSnapshot(book *b);
+void feedTrade(int symbol, int price, int volume);
+
+// For the bars
+void barTrade(market *m, long timestamp, int price, int volume, char side);
+void barWrite(market *m);
+void barsDue();
+void* Barkeeper(void *arg);
+void barsClose(pthread_t t);
+
+// For the lock profile
+pthread_mutex_t *mutexInit();
+void lockTake(pthread_mutex_t *mut);
+int  lockTry(pthread_mutex_t *mut);
+void lockGive(pthread_mutex_t *mut);
+void lockSum(pthread_mutex_t *mut, unsigned long *v);
+void loopsInit(int role, int symbol);
+void loopCount(int useful);
+void* Profiler(void *arg);
+void profileDump(FILE *f);
+void profileClose(FILE *f, pthread_t t);
+
+// For the latency histograms and the benchmark
+stageHist *histLocal();
+int  histIndex(unsigned long v);
+long histValue(int i);
+void histAdd(int stage, long v);
+void histMerge(int stage, histogram *out);
+long histPercentile(histogram *h, double p);
+void latencyReport(FILE *f);
+void stageFill(orderCold *c1, orderCold *c2, long picked);
+void benchReport(const char *path, unsigned int seed, long elapsed);
 
 // General functions
+market *marketInit(int symbol);
+int  symbolOf(long id);
+void dispatch(order *batch, int n);
+void consDispatch(order *batch, int n);
+int  consTake(void *in, order *batch, int wait);
+int  destOf(const order *ord);
+int  queueOf(const order *ord);
+void routeGroup(market *m, int dest, order *group, int k);
+void routeQueue(market *m, queue *q, order *group, int k, int indexed, const char *name);
+void routeBook(market *m, book *b, order *group, int k, const char *name);
+void routeReject(const order *ord, const char *name);
 long getTimestamp();
-order makeOrder();
+long getNanos();
+void stopEngine();
+void wakeTriers();
+void waitOn(pthread_cond_t *cond, pthread_mutex_t *mut, int spins, int idle);
+order makeOrder(generator *g);
+generator *generatorInit(int index, unsigned int seed);
+void rngSeed(rng *r, unsigned long seed);
+unsigned long rngNext(rng *r);
+double rngUniform(rng *r);
 void dispOrder (order ord);
-void trace(long timestamp, int price, order ord1, order ord2, int volume);
+void trace(long timestamp, const tradeFill *f, int n);
 
-pthread_mutex_t lock_transaction  = PTHREAD_MUTEX_INITIALIZER;	//mutex used for locking a transaction
-int currentPriceX10 = 1000;	//current share price *10
+// Engine options
+int sequencer = 0;	// match everything on one pinned thread, without locks
+int seqCore = 0;	// core the sequencer is pinned to
+int ingest = INGEST_QUEUE;	// Prod -> Cons hand-off
+int waitMode = WAIT_BLOCK;	// how Prod, Cons and the triers wait
+int roleCore[NROLES] = {-1, -1, -1, -1, -1, -1, -1};	// core each thread role is pinned to (-1 for any)
+const char *roleName[NROLES] = {"prod", "cons", "bm", "sm", "bl", "sl", "cancel"};
+int fifoPriority = 0;	// SCHED_FIFO priority of the engine threads, 0 for the default policy
+int generators = 1;	// Prod threads, each generating its own orders
+_Atomic int producers;	// Prod threads still running
+void *incoming;	// Prod -> Cons queue or ring
+int nsymbols = 1;	// number of instruments traded
+int workers = 1;	// sequencer workers the symbols are sharded over
+int capacity = 0;	// orders each market queue and book side holds, 0 for no limit
+_Atomic long rejected = 0;	// orders turned away by a full market queue or book side
+long bench = 0;	// benchmark: number of orders to run, without the generator's sleeps
+int allTypes = 0;	// the generators make stop and iceberg orders too
+int verbose = 1;	// print every trade and cancel
+_Atomic int running = 1;	// cleared to stop the triers once the input has ended
+
+// Latency histograms of all threads
+_Atomic(stageHist *) hist_list;
+
+// Lock profile
+int profiling = 0;	// count the waits and holds of the engine locks and the passes of the engine threads
+long profileEvery = 0;	// ms between dumps to profile.txt, 0 for no profile
+FILE *profile_file;
+_Atomic(loopStats *) loop_list;	// passes of every engine thread
+__thread loopStats *myLoops;	// this thread's, if it counts them
+pthread_mutex_t profileMut = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t profileStop = PTHREAD_COND_INITIALIZER;
+int profileDone = 0;	// the Profiler leaves once set
 
 // Log files
 FILE *trace_file;
 FILE *sharePrice;
 //FILE *times;
+FILE *bar_file;	// bars.csv, if bars are built
+long barInterval = 0;	// ms each bar covers, 0 for no bars
+pthread_mutex_t barMut = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t barStop = PTHREAD_COND_INITIALIZER;
+int barDone = 0;	// the Barkeeper leaves once set
+tradeLog *trade_log;	// binary trade log, NULL when writing text
+int textLog = 0;	// write trace.txt and sharePrice.txt directly
+
+// Order files
+orderFile *replay;	// replayed instead of generating orders, if not NULL
+FILE *record_file;	// generated orders are recorded here, if not NULL
+feedRing *feed;	// market data published here, if not NULL
+gateway *gate;	// orders come from the gateway's clients instead of the generators, if not NULL
+
+// Snapshots
+long position = 0;	// orders of the input stream taken so far, by Seq or Cons
+long nextId = 0;	// every id below it has been taken
+long snapEvery = 0;	// orders between snapshots, 0 for none
+long snapDue;	// position the next snapshot is due at
+pid_t snap_child = 0;	// process writing the last snapshot
+journal *order_journal;	// accepted orders go on only once journaled here, if not NULL
+
+// Call auctions
+long auctionOrders = 0;	// orders of each call phase, 0 for continuous trading only
+char phase = 'T';	// 'O' opening call | 'T' continuous trading | 'C' closing call
+long closeAt = -1;	// position the closing call starts at (-1 if none)
 
 /******************** Main function ********************/
-int main()
+int main(int argc, char *argv[])
 {
+    int opt, i;
+    unsigned int seed;
+    
 	// number generator seed for different random sequence per run
-    srand(time(NULL));
-    //srand(0); // or to get the same sequence
+    seed = time(NULL);
+    
+	/********************************/
+	/* -s: sequencer engine mode    */
+	/* -c core: sequencer core      */
+	/* -r seed: random seed         */
+	/* -i mutex|ring|spin: incoming */
+	/*    order hand-off            */
+	/* -n symbols: instruments      */
+	/* -w workers: sequencer shards */
+	/* -l bin|text: trade log       */
+	/* -R file: replay order file   */
+	/* -p: pace replay by timestamp */
+	/* -W file: record orders       */
+	/* -B orders: benchmark run     */
+	/* -q orders: queue capacity    */
+	/* -g threads: generators       */
+	/* -F name: market data feed    */
+	/* -S orders: snapshot interval */
+	/* -L file: restart from a      */
+	/*    snapshot                  */
+	/* -J file: order journal       */
+	/* -j us: journal group commit  */
+	/*    interval                  */
+	/* -A orders: call auctions     */
+	/* -b ms: OHLCV bar interval    */
+	/* -G unix:path|tcp:[host:]port */
+	/*    order gateway             */
+	/* -y block|yield|spin|busy:    */
+	/*    wait strategy             */
+	/* -P role=core,...: pin the    */
+	/*    thread roles to cores     */
+	/* -f priority: SCHED_FIFO      */
+	/* -K ms: lock profile interval */
+	/********************************/
+	
+    char *replayPath = NULL, *recordPath = NULL, *feedName = NULL, *loadPath = NULL, *journalPath = NULL, *gatewayAddr = NULL;
+    const snapshotHeader *snap = NULL;
+    int paced = 0, seeded = 0;
+    long elapsed, restored, journalInterval = 0, total;
+    
+    while ((opt = getopt(argc, argv, "sc:r:i:n:w:l:R:pW:B:q:g:F:S:L:J:j:A:b:G:y:P:f:K:t")) != -1)
+	{
+        switch (opt)
+		{
+            case 's': sequencer = 1; break;
+            case 'c': seqCore = atoi(optarg); break;
+            case 'r': seed = atoi(optarg); seeded = 1; break;	// e.g. -r 0 to get the same sequence
+            case 'i':
+                if (strcmp(optarg, "ring") == 0) ingest = INGEST_RING;
+                else if (strcmp(optarg, "spin") == 0) ingest = INGEST_SPIN;
+                else ingest = INGEST_QUEUE;
+                break;
+            case 'n': nsymbols = atoi(optarg); break;
+            case 'w': workers = atoi(optarg); break;
+            case 'l': textLog = (strcmp(optarg, "text") == 0); break;
+            case 'R': replayPath = optarg; break;
+            case 'p': paced = 1; break;
+            case 'W': recordPath = optarg; break;
+            case 'B': bench = atol(optarg); break;
+            case 'q': capacity = atoi(optarg); break;
+            case 'g': generators = atoi(optarg); break;
+            case 'F': feedName = optarg; break;
+            case 'S': snapEvery = atol(optarg); break;
+            case 'L': loadPath = optarg; break;
+            case 'J': journalPath = optarg; break;
+            case 'j': journalInterval = atol(optarg); break;
+            case 'A': auctionOrders = atol(optarg); break;
+            case 'b': barInterval = atol(optarg); break;
+            case 'G': gatewayAddr = optarg; break;
+            case 'y':
+                if (strcmp(optarg, "yield") == 0) waitMode = WAIT_YIELD;
+                else if (strcmp(optarg, "spin") == 0) waitMode = WAIT_SPIN;
+                else if (strcmp(optarg, "busy") == 0) waitMode = WAIT_BUSY;
+                else waitMode = WAIT_BLOCK;
+                break;
+            case 'P':
+                if (placeParse(optarg) != 0)
+				{
+                    fprintf(stderr, "%s: expected role=core,... with the roles prod, cons, bm, sm, bl, sl and cancel\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'f': fifoPriority = atoi(optarg); break;
+            case 'K': profileEvery = atol(optarg); break;
+            case 't': allTypes = 1; break;
+            default :
+                fprintf(stderr, "Usage: %s [-s] [-c core] [-r seed] [-i mutex|ring|spin] [-n symbols] [-w workers] [-l bin|text] [-R file [-p] | -W file] [-B orders] [-q capacity] [-g generators] [-F feed] [-S orders] [-L snapshot] [-J journal [-j us]] [-A orders] [-b ms] [-G unix:path|tcp:[host:]port] [-y block|yield|spin|busy] [-P role=core,...] [-f priority] [-K ms] [-t]\n", argv[0]);
+                exit(1);
+        }
+    }
+    
+	// a replay trades the symbols it was recorded with
+    if (replayPath != NULL)
+	{
+        replay = replayOpen(replayPath, paced);
+        if (replay == NULL)
+		{
+            fprintf(stderr, "%s: cannot map order file of this build\n", replayPath);
+            exit(1);
+        }
+        nsymbols = replay->nsymbols;
+    }
+	// a snapshot brings back the symbols it was taken with
+    if (loadPath != NULL)
+	{
+        snap = snapshotOpen(loadPath);
+        if (snap == NULL)
+		{
+            fprintf(stderr, "%s: cannot map snapshot of this build\n", loadPath);
+            exit(1);
+        }
+        if (replay != NULL && replay->nsymbols != snap->nsymbols)
+		{
+            fprintf(stderr, "%s: taken with %d symbols, the replay has %d\n", loadPath, snap->nsymbols, replay->nsymbols);
+            exit(1);
+        }
+		// the replay has to go on from the snapshot's position without a gap
+        if (replay != NULL && snap->position < replay->offset)
+		{
+            fprintf(stderr, "%s: taken at order %ld, %s starts at order %ld\n", loadPath, snap->position, replayPath, replay->offset);
+            exit(1);
+        }
+        nsymbols = snap->nsymbols;
+    }
+	// an order file written after a restart only follows its snapshot
+    if (replay != NULL && replay->offset > 0 && snap == NULL)
+	{
+        fprintf(stderr, "%s: starts at order %ld, restore the snapshot it follows with -L\n", replayPath, replay->offset);
+        exit(1);
+    }
+    if (recordPath != NULL && replay == NULL)
+	{
+        record_file = recordOpen(recordPath, (snap != NULL) ? snap->position : 0);
+        if (record_file == NULL)
+		{
+            perror(recordPath);
+            exit(1);
+        }
+    }
+	// the sequencer workers each own their books and never stop all at once
+    if (snapEvery > 0 && sequencer && workers > 1)
+	{
+        fprintf(stderr, "Snapshots need the threaded engine or a single sequencer\n");
+        exit(1);
+    }
+    if (nsymbols < 1 || nsymbols > MAXSYMBOLS || workers < 1 || generators < 1)
+	{
+        fprintf(stderr, "Expected 1 to %d symbols and at least one worker and generator\n", MAXSYMBOLS);
+        exit(1);
+    }
+	// the gateway's clients take the place of the generators
+    if (gatewayAddr != NULL && (replayPath != NULL || recordPath != NULL || bench > 0))
+	{
+        fprintf(stderr, "The gateway takes the place of the generators, not with -R, -W or -B\n");
+        exit(1);
+    }
+	// a replay is one stream, and the single sequencer generates its own orders
+    if (replay != NULL || (sequencer && workers == 1))
+        generators = 1;
+    
+	// a benchmark runs a fixed, seeded order stream quietly
+    if (bench > 0)
+	{
+        if (!seeded)
+            seed = 0;
+        verbose = 0;
+    }
     
     // start the time for timestamps
-    gettimeofday (&startwtime, NULL);
+    clock_gettime (CLOCK_MONOTONIC, &startwtime);
     
 	/********************************/
-	/* prod_t: producer             */
+	/* prod_t: producers (-g)       */
 	/* cons_t: consumer             */
 	/* bmTry_t: buy market trier    */ 
 	/* blTry_t: buy limit trier     */
 	/* smTry_t: sell market trier   */
 	/* slTry_t: sell market trier   */
 	/* cancelTry_t: cancel trier    */
+	/* (one set per symbol)         */
+	/* seq_t: sequencer (-s)        */
+	/* worker_t: sequencer shards   */
+	/*   (-s with -w > 1)           */
+	/* log_t: trade log writer      */
+	/* gate_t: order gateway (-G),  */
+	/*   instead of the producers   */
+	/* prof_t: lock profile (-K)    */
+	/* bar_t: bar publisher (-b)    */
 	/********************************/
 	
-    pthread_t prod_t,cons_t,bmTry_t,smTry_t,blTry_t,slTry_t,cancelTry_t;
+    pthread_t cons_t,seq_t,log_t,journal_t,gate_t,prof_t,bar_t;
+    pthread_t *prod_t = NULL,*bmTry_t = NULL,*smTry_t = NULL,*blTry_t = NULL,*slTry_t = NULL,*cancelTry_t = NULL,*worker_t = NULL;
 	
-	// open log files
-    trace_file = fopen("trace.txt","wt");
-    sharePrice = fopen("sharePrice.txt","wt");
+	// open log files, trades.bin is turned into them offline by TraceDump
+    if (textLog)
+	{
+        trace_file = fopen("trace.txt","wt");
+        sharePrice = fopen("sharePrice.txt","wt");
+    }
+    else
+	{
+        trade_log = tradeLogInit("trades.bin");
+        if (trade_log == NULL)
+		{
+            perror("trades.bin");
+            exit(1);
+        }
+        pthread_create(&log_t,NULL,Logger,trade_log);
+    }
 	//times = fopen("times.txt","wt");
+    if (barInterval > 0)
+	{
+        bar_file = fopen("bars.csv","wt");
+        if (bar_file == NULL)
+		{
+            perror("bars.csv");
+            exit(1);
+        }
+        fprintf(bar_file, "symbol,start_ms,open,high,low,close,trades,volume,vwap,running_vwap,buy_volume,sell_volume\n");
+    }
+    if (feedName != NULL)
+	{
+        feed = feedOpen(feedName);
+        if (feed == NULL)
+		{
+            perror(feedName);
+            exit(1);
+        }
+    }
     
-    queue* q;
-	
-    // initialize queues
-    q = queueInit();
-    bm_q = queueInit();
-    sm_q = queueInit();
-    bl_q = queueInit();
-    sl_q = queueInit();
-    cancel_q = queueInit();
-    
-    /********** Create threads **********/
-    pthread_create(&prod_t,NULL,Prod,q);
-    pthread_create(&cons_t,NULL,Cons,q);
-	
-	// transaction threads
-    pthread_create(&bmTry_t,NULL,BMTry,NULL);
-    pthread_create(&smTry_t,NULL,SMTry,NULL);
-    pthread_create(&blTry_t,NULL,BLTry,NULL);
-    pthread_create(&slTry_t,NULL,SLTry,NULL);
-    pthread_create(&cancelTry_t,NULL,CancelTry,NULL);
-    
-	// Join threads
-	// I actually do not expect them to ever terminate
-    pthread_join(prod_t,NULL);
-    pthread_join(cons_t,NULL);
-    pthread_join(bmTry_t,NULL);
-    pthread_join(smTry_t,NULL);
-    pthread_join(blTry_t,NULL);
-    pthread_join(slTry_t,NULL);
-    pthread_join(cancelTry_t,NULL);
-    
-    pthread_exit(NULL);
-}
-
-/******************** Producer function ********************/
-void *Prod (void *arg)
-{
-	queue *q = (queue *) arg;
-    int magnitude=10;
-    while(1)
+    if (journalPath != NULL)
 	{
-        // wait for a random amount of time in useconds
-        //int waitmsec = ((double)rand() / (double)RAND_MAX * magnitude);
-        //usleep(waitmsec*1000);
-        
-        pthread_mutex_lock (q->mut);
-        while (q->full)
+		// a replayed journal must not be truncated under the replay
+        if (replayPath != NULL && strcmp(replayPath, journalPath) == 0)
 		{
-			// This is bad and should not happen!
-            printf ("*** Incoming Order Queue is FULL.\n"); fflush(stdout);
-            pthread_cond_wait (q->notFull, q->mut);
+            fprintf(stderr, "%s: cannot journal to the file being replayed\n", journalPath);
+            exit(1);
         }
-        queueAdd (q, makeOrder());
-        pthread_mutex_unlock (q->mut);
-        pthread_cond_signal (q->notEmpty);
+        order_journal = journalInit(journalPath, journalInterval, (snap != NULL) ? snap->position : 0);
+        if (order_journal == NULL)
+		{
+            perror(journalPath);
+            exit(1);
+        }
+        pthread_create(&journal_t,NULL,Journaler,order_journal);
     }
-    return;
-}
-
-/******************** Consumer function ********************/
-void* Cons (void* arg)
-{
-    queue *q = (queue *) arg;
-    order ord;
     
-    while(1)
+    if (gatewayAddr != NULL)
 	{
-        // Select an order 
-        pthread_mutex_lock (q->mut);
-        while (q->empty) 
+        gate = gatewayOpen(gatewayAddr);
+        if (gate == NULL)
 		{
-            printf ("*** Incoming Order Queue is EMPTY.\n"); fflush(stdout);
-            pthread_cond_wait(q->notEmpty, q->mut);
+            perror(gatewayAddr);
+            exit(1);
         }
-        queueDel(q, &ord);
-        pthread_mutex_unlock(q->mut);
-        pthread_cond_signal(q->notFull);
-        
-        // Move order from arrival queue to one of our queues
-		// and signal appropriate handler to deal with it
-		
-		switch (ord.type)
+        printf ("*** Gateway listening on %s.\n", gatewayAddr); fflush(stdout);
+    }
+    
+    generator **gens;
+	
+    // initialize queues
+    if (ingest == INGEST_QUEUE)
+	{
+        incoming = queueInit(QUEUESIZE);
+        ((queue *) incoming)->pool.node = cpuNode(roleCore[ROLE_CONS]);
+    }
+    else
+        incoming = mpscInit(ingest == INGEST_RING && waitMode != WAIT_BUSY);
+    gens = (generator **) malloc (generators * sizeof (generator *));
+    for (i = 0; i < generators; i++)
+        gens[i] = generatorInit(i, seed);
+    markets = (market **) malloc (nsymbols * sizeof (market *));
+    for (i = 0; i < nsymbols; i++)
+        markets[i] = marketInit(i);
+    
+	// restart: bring the markets back, then take the stream up where the snapshot left it
+    if (snap != NULL)
+	{
+        restored = snapshotRestore(snap);
+        printf ("*** Restored %ld orders from %s, resuming at order %ld.\n", restored, loadPath, position); fflush(stdout);
+        if (replay != NULL)
+            replay->next = (position - replay->offset < replay->count) ? position - replay->offset : replay->count;
+        for (i = 0; i < generators; i++)
+            gens[i]->count = (nextId > i) ? (nextId - i + generators - 1) / generators : 0;
+    }
+    snapDue = position + snapEvery;
+    
+	// the opening call lasts the first auctionOrders orders, and the closing
+	// call the last ones if we know where the stream ends
+    if (auctionOrders > 0)
+	{
+        if (position < auctionOrders)
+            phase = 'O';
+        for (i = 0; i < nsymbols; i++)
+            markets[i]->auction = (phase == 'O');
+        total = (bench > 0) ? bench : (replay != NULL) ? replay->offset + replay->count : -1;
+        if (total - auctionOrders > auctionOrders)
+            closeAt = total - auctionOrders;
+    }
+    
+	// the engine locks are counted from before the first thread takes one
+    if (profileEvery > 0)
+	{
+        profile_file = fopen("profile.txt","wt");
+        if (profile_file == NULL)
 		{
-			case 'M':
-			{
-				switch(ord.action)
-				{
-					case 'B':
-					{
-						pthread_mutex_lock(bm_q->mut);
-						while (bm_q->full) 
-						{
-							printf ("*** Buy Market Queue is FULL.\n"); fflush(stdout);
-							pthread_cond_wait(bm_q->notFull, bm_q->mut);
-						}
-						
-						queueAdd(bm_q, ord);
-						pthread_mutex_unlock(bm_q->mut);
-						pthread_cond_signal(bm_q->notEmpty);
-						break;
-					}
-					case 'S':
-					{
-						pthread_mutex_lock(sm_q->mut);
-						while (sm_q->full) 
-						{
-							printf ("*** Sell MarketFIFO is FULL.\n"); fflush(stdout);
-							pthread_cond_wait(sm_q->notFull, sm_q->mut);
-						}
-                
-						queueAdd(sm_q, ord);
-						pthread_mutex_unlock(sm_q->mut);
-						pthread_cond_signal(sm_q->notEmpty);
-						break;
-					}
-					default : break;
-				}
-				break;
-			}
-			case 'L':
-			{
-				switch(ord.action)
-				{
-					case 'B':
-					{
-						pthread_mutex_lock(bl_q->mut);
-						while (bl_q->full)
-						{
-							printf ("*** Buy Limit Queue is FULL.\n"); fflush(stdout);
-							pthread_cond_wait(bl_q->notFull, bl_q->mut);
-						}
-                
-						heapInsert(bl_q, ord);
-						pthread_mutex_unlock(bl_q->mut);
-						pthread_cond_signal(bl_q->notEmpty);
-						break;
-					}
-					case 'S':
-					{
-						pthread_mutex_lock(sl_q->mut);
-						while (sl_q->full) 
-						{
-							printf ("*** Sell Limit Queue is FULL.\n"); fflush(stdout);
-							pthread_cond_wait(sl_q->notFull, sl_q->mut);
-						}
-                
-						heapInsert(sl_q, ord);
-						pthread_mutex_unlock(sl_q->mut);
-						pthread_cond_signal(sl_q->notEmpty);
-						//break;
-					}
-					default : break;
-				}
-				break;
-			}
-			case 'C':
-			{
-				pthread_mutex_lock(cancel_q->mut);
-                while (cancel_q->full)
-				{
-                    printf ("*** Cancel Queue is FULL.\n"); fflush(stdout);
-                    pthread_cond_wait(cancel_q->notFull, cancel_q->mut);
-                }
-            
-                queueAdd(cancel_q, ord);
-                pthread_mutex_unlock(cancel_q->mut);
-                pthread_cond_signal(cancel_q->notEmpty);
-				break;
-			}
-			default : break;
-		}
-
+            perror("profile.txt");
+            exit(1);
+        }
+        profiling = 1;
+        pthread_create(&prof_t,NULL,Profiler,profile_file);
     }
-	// Display message when the order is executed
-	//printf ("Processing at time %8ld : ", getTimestamp());
-	//dispOrder(ord); fflush(stdout);
-    return;
-}
-
-/******************** Threads-triers ********************/
-
-/********** Try a Buy Market transaction**********/
-void* BMTry()
-{
-    int done = 0;
+    if (bar_file != NULL)
+        pthread_create(&bar_t,NULL,Barkeeper,NULL);
     
-    while(1)
+	// the gateway's ids carry on after the restored ones
+    if (gate != NULL)
+	{
+        gate->seq = nextId / GWCONNS + 1;
+        pthread_create(&gate_t,NULL,Gateway,gate);
+    }
+    
+    // A single sequencer replaces all the other threads
+    if (sequencer && workers == 1)
+	{
+        pthread_create(&seq_t,NULL,Seq,gens[0]);
+        pthread_join(seq_t,NULL);
+    }
+    else
 	{
-        // Wait for a buy market order 
-        pthread_mutex_lock(bm_q->mut);
-        while (bm_q->empty) 
+        /********** Create threads **********/
+        if (sequencer)
 		{
-            //printf ("*** Buy Market Queue is EMPTY.\n"); fflush(stdout);
-            pthread_cond_wait(bm_q->notEmpty, bm_q->mut);
+			// sequencer workers, Cons routes each symbol to one of them
+            shard_q = (spscRing **) malloc (workers * sizeof (spscRing *));
+            worker_t = (pthread_t *) malloc (workers * sizeof (pthread_t));
+            for (i = 0; i < workers; i++)
+                shard_q[i] = spscInit(1);
         }
+        prod_t = (pthread_t *) malloc (generators * sizeof (pthread_t));
+        atomic_init(&producers, generators);
+        for (i = 0; i < generators && gate == NULL; i++)
+            roleCreate(&prod_t[i],ROLE_PROD,Prod,gens[i]);
+        roleCreate(&cons_t,ROLE_CONS,Cons,incoming);
         
-        // Try a Buy Market- Sell Limit transaction
-        if (pthread_mutex_trylock(sl_q->mut) == 0) 
+        if (sequencer)
+		{
+            for (i = 0; i < workers; i++)
+                pthread_create(&worker_t[i],NULL,Worker,(void *)(long) i);
+        }
+        else
 		{
-            if ((sl_q->empty == 0) && (sl_q->item[1].price < currentPriceX10))
+			// transaction threads
+            bmTry_t = (pthread_t *) malloc (nsymbols * sizeof (pthread_t));
+            smTry_t = (pthread_t *) malloc (nsymbols * sizeof (pthread_t));
+            blTry_t = (pthread_t *) malloc (nsymbols * sizeof (pthread_t));
+            slTry_t = (pthread_t *) malloc (nsymbols * sizeof (pthread_t));
+            cancelTry_t = (pthread_t *) malloc (nsymbols * sizeof (pthread_t));
+            for (i = 0; i < nsymbols; i++)
 			{
-                pthread_mutex_lock(&lock_transaction);
-                MLtrans (bm_q, sl_q);
-                pthread_mutex_unlock(&lock_transaction);
-                done = 1;
+                roleCreate(&bmTry_t[i],ROLE_BM,BMTry,markets[i]);
+                roleCreate(&smTry_t[i],ROLE_SM,SMTry,markets[i]);
+                roleCreate(&blTry_t[i],ROLE_BL,BLTry,markets[i]);
+                roleCreate(&slTry_t[i],ROLE_SL,SLTry,markets[i]);
+                roleCreate(&cancelTry_t[i],ROLE_CANCEL,CancelTry,markets[i]);
             }
-            pthread_mutex_unlock(sl_q->mut);
         }
         
-        // If no Buy Market - Sell Limit transaction was achieved, try a Market - Market transaction
-        if (done == 0) 
+		// Join threads
+		// They run until the order stream ends, which the generator never does
+		// unless it is benchmarking
+        for (i = 0; i < generators && gate == NULL; i++)
+            pthread_join(prod_t[i],NULL);
+        pthread_join(cons_t,NULL);
+        if (sequencer)
+		{
+            for (i = 0; i < workers; i++)
+                pthread_join(worker_t[i],NULL);
+        }
+        else
 		{
-            if (pthread_mutex_trylock(sm_q->mut) == 0) 
+            stopEngine();
+            for (i = 0; i < nsymbols; i++)
 			{
-                if (sm_q->empty == 0) 
-				{
-                    pthread_mutex_lock(&lock_transaction);
-                    MMtrans (bm_q, sm_q);
-                    pthread_mutex_unlock(&lock_transaction);
-                }
-                pthread_mutex_unlock(sm_q->mut);
+                pthread_join(bmTry_t[i],NULL);
+                pthread_join(smTry_t[i],NULL);
+                pthread_join(blTry_t[i],NULL);
+                pthread_join(slTry_t[i],NULL);
+                pthread_join(cancelTry_t[i],NULL);
             }
+            
+			// the triers gave up on whatever they did not get to, finish it
+            for (i = 0; i < nsymbols; i++)
+                do
+                    while (!markets[i]->auction && seqMatch(markets[i]));
+                while (stopsRoute(markets[i]) > 0);
         }
-        pthread_mutex_unlock(bm_q->mut);
-        done = 0;
     }
-    return;
+    elapsed = getNanos();
+    
+	// the last reports go out before the gateway closes its connections
+    if (gate != NULL)
+        gatewayClose(gate, gate_t);
+    if (profile_file != NULL)
+        profileClose(profile_file, prof_t);
+	// let the last snapshot finish
+    if (snap_child > 0)
+        waitpid(snap_child, NULL, 0);
+	// flush the logs
+    if (bar_file != NULL)
+        barsClose(bar_t);
+    if (order_journal != NULL)
+        journalClose(order_journal, journal_t);
+    if (trade_log != NULL)
+        tradeLogClose(trade_log, log_t);
+    if (textLog)
+	{
+        fclose(trace_file);
+        fclose(sharePrice);
+    }
+    if (record_file != NULL)
+        fclose(record_file);
+    
+    if (rejected > 0)
+	{
+        printf ("*** %ld orders rejected, their queue or book side was full.\n", (long) rejected); fflush(stdout);
+    }
+    if (bench > 0)
+        benchReport("bench.json", seed, elapsed);
+    else
+        latencyReport(stdout);
+    
+    return (0);
 }
 
-/********** Try a Sell Market transaction**********/
-void* SMTry()
+/******************** Stop engine function ********************/
+void stopEngine()
+{
+	/*************************************************************************/
+	/* Clears running and wakes every trier. The flag is set before each     */
+	/* queue lock is taken to broadcast, so a trier about to wait sees it.   */
+	/*************************************************************************/
+	
+    atomic_store(&running, 0);
+    wakeTriers();
+}
+
+/******************** Wait function ********************/
+void waitOn(pthread_cond_t *cond, pthread_mutex_t *mut, int spins, int idle)
 {
-    int done = 0;
+	/*************************************************************************/
+	/* One turn of a wait for a condition guarded by mut, which the caller   */
+	/* holds and checks again after each turn; spins counts the turns so    */
+	/* far. Only a blocked thread needs the signal, the others let the mutex */
+	/* go and take it back, and a signal with no thread blocked is cheap.    */
+	/* An idle trier has nothing to wait for but its own side, as the other */
+	/* side's trier may take the trade, so it blocks for IDLEWAIT at most.   */
+	/*************************************************************************/
+	
+    lockStats *s = (lockStats *) mut;
+    struct timespec t;
     
-    while(1)
+	// the turn is an idle pass, and the mutex is not held while it lasts
+    loopCount(0);
+    if (profiling)
+        statAdd(s->held, getNanos() - s->since);
+    
+    if (waitMode == WAIT_BLOCK || (waitMode == WAIT_SPIN && spins >= SPINCOUNT))
 	{
-        
-        // Wait for a sell market order 
-        pthread_mutex_lock(sm_q->mut);
-        while (sm_q->empty) 
-		{
-            // printf ("*** Sell Market Queue is EMPTY.\n"); fflush(stdout);
-            pthread_cond_wait(sm_q->notEmpty, sm_q->mut);
-        }
-        
-        // Try a Sell Market - Buy Limit transaction
-        if (pthread_mutex_trylock(bl_q->mut) == 0)
-		{
-            if ((bl_q->empty == 0) && (bl_q->item[1].price > currentPriceX10))
-			{
-                pthread_mutex_lock(&lock_transaction);
-                MLtrans (sm_q, bl_q);
-                pthread_mutex_unlock(&lock_transaction);
-                done = 1;
-            }
-            pthread_mutex_unlock(bl_q->mut);
-        }
-        
-        // If no Sell Market - Buy Limit transaction was achieved, try a Market - Market transaction
-        if (done == 0) 
+        if (!idle)
+            pthread_cond_wait(cond, mut);
+        else
 		{
-            if (pthread_mutex_trylock(bm_q->mut) == 0)
+            clock_gettime(CLOCK_REALTIME, &t);
+            t.tv_nsec += IDLEWAIT * 1000;
+            if (t.tv_nsec >= 1000000000)
 			{
-                if (bm_q->empty == 0)
-				{
-                    pthread_mutex_lock(&lock_transaction);
-                    MMtrans (sm_q, bm_q);
-                    pthread_mutex_unlock(&lock_transaction);
-                }
-                pthread_mutex_unlock(bm_q->mut);
+                t.tv_sec++;
+                t.tv_nsec -= 1000000000;
             }
+            pthread_cond_timedwait(cond, mut, &t);
         }
-        pthread_mutex_unlock(sm_q->mut);
-        done = 0;
     }
-    return;
+    else
+	{
+        pthread_mutex_unlock(mut);
+        if (waitMode == WAIT_YIELD)
+            sched_yield();
+        else
+            cpuRelax();
+        pthread_mutex_lock(mut);
+    }
+    
+    if (profiling)
+        s->since = getNanos();
 }
 
-/********** Try a Buy Limit transaction**********/
-void* BLTry()
+/******************** Wake the triers function ********************/
+void wakeTriers()
+{
+    int i;
+    market *m;
+    
+    for (i = 0; i < nsymbols; i++)
+	{
+        m = markets[i];
+        lockTake(m->bm_q->mut);
+        pthread_cond_broadcast(m->bm_q->notEmpty);
+        lockGive(m->bm_q->mut);
+        lockTake(m->sm_q->mut);
+        pthread_cond_broadcast(m->sm_q->notEmpty);
+        lockGive(m->sm_q->mut);
+        lockTake(m->bl_q->mut);
+        pthread_cond_broadcast(m->bl_q->notEmpty);
+        lockGive(m->bl_q->mut);
+        lockTake(m->sl_q->mut);
+        pthread_cond_broadcast(m->sl_q->notEmpty);
+        lockGive(m->sl_q->mut);
+        lockTake(m->cancel_q->mut);
+        pthread_cond_broadcast(m->cancel_q->notEmpty);
+        lockGive(m->cancel_q->mut);
+    }
+}
+
+/******************** Producer function ********************/
+void *Prod (void *arg)
 {
-    int done = 0;
+    generator *g = (generator *) arg;
+	queue *q = (queue *) incoming;
+    mpscRing *r = (mpscRing *) incoming;
+    const order *batch;
+    order ord, stamped[RINGBATCH];
+    long now;
+    int i, n, spins;
     
-    while(1) 
+    loopsInit(ROLE_PROD, g->index);
+    while ((n = nextOrders(g, &batch, RINGBATCH)) > 0)
 	{
-        // Wait for a buy limit order 
-        pthread_mutex_lock(bl_q->mut);
-        while (bl_q->empty) 
-		{
-            // printf ("*** Buy Limit Queue is EMPTY.\n"); fflush(stdout);
-            pthread_cond_wait(bl_q->notEmpty, bl_q->mut);
-        }
+        loopCount(1);
+        
+		// the batch may be a read-only replay, stamp a copy
+        now = getNanos();
+        memcpy(stamped, batch, n * sizeof (order));
+        for (i = 0; i < n; i++)
+            stamped[i].enqueued = now;
         
-        // Try a Buy Limit - Sell Market transaction
-        if (pthread_mutex_trylock(sm_q->mut) == 0)
+        if (ingest != INGEST_QUEUE)
 		{
-            if (sm_q->empty == 0) 
-			{
-                pthread_mutex_lock(&lock_transaction);
-                LMtrans (bl_q, sm_q);
-                pthread_mutex_unlock(&lock_transaction);
-                done = 1;
-            }
-            pthread_mutex_unlock(sm_q->mut);
+            mpscPut (r, stamped, n);
+            continue;
         }
         
-        // If no Buy Limit - Sell Market was achieved, try Limit - Limit transaction
-        if (done== 0) 
+        for (i = 0; i < n; i++)
 		{
-            if (pthread_mutex_trylock(sl_q->mut) == 0)
+            stamped[i].enqueued = getNanos();
+            lockTake(q->mut);
+            for (spins = 0; q->full; spins++)
 			{
-                if ((sl_q->empty == 0)&&(bl_q->item[1].price >= sl_q->item[1].price))
-				{
-                    pthread_mutex_lock(&lock_transaction);
-                    LLtrans (bl_q, sl_q);
-                    pthread_mutex_unlock(&lock_transaction);
-                }
-                pthread_mutex_unlock(sl_q->mut);
+				// This is bad and should not happen!
+                if (spins == 0) { printf ("*** Incoming Order Queue is FULL.\n"); fflush(stdout); }
+                waitOn (q->notFull, q->mut, spins, 0);
             }
+            queueAdd (q, stamped[i]);
+            lockGive(q->mut);
+            pthread_cond_signal (q->notEmpty);
         }
-        pthread_mutex_unlock(bl_q->mut);
-        done= 0;
     }
-    return;
+    
+	// the last producer to finish tells Cons the stream has ended
+    if (atomic_fetch_sub(&producers, 1) > 1)
+        return (NULL);
+    ord.type = 'E';
+    if (ingest != INGEST_QUEUE)
+        mpscPut (r, &ord, 1);
+    else
+	{
+        lockTake(q->mut);
+        for (spins = 0; q->full; spins++)
+            waitOn (q->notFull, q->mut, spins, 0);
+        queueAdd (q, ord);
+        lockGive(q->mut);
+        pthread_cond_signal (q->notEmpty);
+    }
+    printf ("*** End of the order stream.\n"); fflush(stdout);
+    return (NULL);
 }
 
-/********** Try a Sell Limit transaction**********/
-void* SLTry()
+/******************** Consumer function ********************/
+void* Cons (void* arg)
 {
-    int done = 0;
+	/*************************************************************************/
+	/* Takes the incoming orders in batches and hands them on to the         */
+	/* markets. With a journal an order is only handed on once it is         */
+	/* durable: Cons appends what it takes and carries on taking, without    */
+	/* waiting, while the writer commits; it waits for the writer only when  */
+	/* nothing comes in, the journal is full or the stream has ended.        */
+	/*************************************************************************/
+	
+    journal *j = order_journal;
+    order batch[RINGBATCH], ready[RINGBATCH];
+    int i, n, k, end;
     
+    loopsInit(ROLE_CONS, -1);
     while(1)
 	{
+        if (j != NULL && journalRoom(j) < RINGBATCH)
+            n = 0;
+        else
+            n = consTake(arg, batch, j == NULL || !journalPending(j));
+        loopCount(n > 0);
+        for (i = 0; i < n && batch[i].type != 'E'; i++);
+        end = (i < n);
         
-        // Wait for a sell limit order **/
-        pthread_mutex_lock(sl_q->mut);
-        while (sl_q->empty)
+        if (j == NULL)
+            consDispatch(batch, i);
+        else
 		{
-            // printf ("*** Buy Limit Queue is EMPTY.\n"); fflush(stdout);
-            pthread_cond_wait(sl_q->notEmpty, sl_q->mut);
-        }
-        
-        // Try a Sell Limit - Buy Market transaction
-        if (pthread_mutex_trylock(bm_q->mut) == 0)
-		{
-            if (bm_q->empty == 0) 
+            journalAppend(j, batch, i);
+			// wait for the writer if nothing came in, and for all of it at the end
+            do
 			{
-                pthread_mutex_lock(&lock_transaction);
-                LMtrans (sl_q, bm_q);
-                pthread_mutex_unlock(&lock_transaction);
-                done = 1;
-            }
-            pthread_mutex_unlock(bm_q->mut);
+                k = journalTake(j, ready, RINGBATCH, i == 0 || end);
+                consDispatch(ready, k);
+            } while (end && journalPending(j));
         }
         
-        // If no Sell Limit - Buy Market was achieved, try Limit - Limit transaction
-        if (done == 0)
+        if (end)
 		{
-            if (pthread_mutex_trylock(bl_q->mut)== 0)
-			{
-                if ((bl_q->empty == 0)&&(bl_q->item[1].price >= sl_q->item[1].price))
-				{
-                    pthread_mutex_lock(&lock_transaction);
-                    LLtrans (sl_q, bl_q);
-                    pthread_mutex_unlock(&lock_transaction);
-                }
-                pthread_mutex_unlock(bl_q->mut);
-            }
+			// end of the stream, pass it on to the sequencer workers
+            streamEnded();
+            if (sequencer)
+                for (n = 0; n < workers; n++)
+                    spscPut(shard_q[n], &batch[i], 1);
+            return (NULL);
         }
-        pthread_mutex_unlock(sl_q->mut);
-        done = 0;
     }
-    return;
+	// Display message when the order is executed
+	//printf ("Processing at time %8ld : ", getTimestamp());
+	//dispOrder(ord); fflush(stdout);
+    return (NULL);
 }
 
-
-/******************** Transaction functions ********************/
-
-/********** Buy Market - Sell Market transaction**********/
-void MMtrans (queue *q1, queue *q2)
- {
-    int volume = 0;
-    order ord1,ord2,trash;
+/******************** Take incoming orders function ********************/
+int consTake(void *in, order *batch, int wait)
+{
+	// takes up to a batch of the orders waiting, or none if there are none and we may not wait
+    queue *q = (queue *) in;
+    mpscRing *r = (mpscRing *) in;
+    int n, spins;
     
-    ord1 = q1->item[q1->head];
-    ord2 = q2->item[q2->head];
+    if (ingest != INGEST_QUEUE)
+        return (wait ? mpscTake(r, batch, RINGBATCH) : mpscPop(r, batch, RINGBATCH));
     
-    if (ord1.vol > ord2.vol)
-	{
-        ord1.vol = ord1.vol - ord2.vol;
-        volume = ord2.vol;
-        queueDel(q2, &trash);
-        pthread_cond_signal(q2->notFull);
-    }
-    else if(ord1.vol < ord2.vol)
+    lockTake(q->mut);
+    for (spins = 0; q->empty && wait; spins++)
 	{
-        ord2.vol = ord2.vol-ord1.vol;
-        volume = ord1.vol;
-        queueDel(q1, &trash);
-        pthread_cond_signal(q1->notFull);
+        if (verbose && spins == 0) { printf ("*** Incoming Order Queue is EMPTY.\n"); fflush(stdout); }
+        waitOn(q->notEmpty, q->mut, spins, 0);
     }
-    else
-	{
-        volume = ord1.vol;
-        queueDel(q1, &trash);
-        pthread_cond_signal(q1->notFull);
-        queueDel(q2, &trash);
-        pthread_cond_signal(q2->notFull);
-    }
-    trace(getTimestamp(), currentPriceX10, ord1, ord2, volume);
-	dispOrder (trash); fflush(stdout);
+    for (n = 0; n < RINGBATCH && !q->empty; n++)
+        queueDel(q, &batch[n]);
+    lockGive(q->mut);
+    if (n > 0)
+        pthread_cond_signal(q->notFull);
+    
+    return (n);
 }
 
-/********** Buy Market - Sell Limit transaction**********/
-void MLtrans (queue *q1, queue *q2) 
+/******************** Hand orders on function ********************/
+void consDispatch(order *batch, int n)
 {
-    int volume = 0;
-    order trash, ord1,ord2;
-    
-    ord1 = q1->item[q1->head];
-    ord2 = q2->item[1];
-    currentPriceX10 = ord2.price;
+    long now;
+    int i;
     
-    if (ord1.vol > ord2.vol)
+    now = getNanos();
+    for (i = 0; i < n; i++)
 	{
-        ord1.vol = ord1.vol - ord2.vol;
-        volume = ord2.vol;
-        heapDel(q2, &trash);
-        pthread_cond_signal(q2->notFull);
+        batch[i].dispatched = now;
+        histAdd(STAGE_QUEUE, now - batch[i].enqueued);
     }
-    else if(ord1.vol < ord2.vol)
-	{
-        ord2.vol = ord2.vol - ord1.vol;
-        volume = ord1.vol;
-        queueDel(q1, &trash);
-        pthread_cond_signal(q1->notFull);
-    }
-    else 
-	{
-        volume = ord1.vol;
-        heapDel(q2, &trash);
-        pthread_cond_signal(q2->notFull);
-        queueDel(q1, &trash);
-        pthread_cond_signal(q1->notFull);
-    }
-    trace(getTimestamp(), currentPriceX10, ord1, ord2, volume);
-	dispOrder (trash); fflush(stdout);
+    if (gate != NULL)
+        gatewayAck(batch, n);
+    dispatch(batch, n);
+    streamTaken(batch, n);
 }
 
-/********** Buy Limit - Sell Market transaction**********/
-void LMtrans (queue *q1, queue *q2)
- {
-    int volume = 0;
-    order trash, ord1,ord2;
-    
-    ord1 = q1->item[1];
-    ord2 = q2->item[q2->head];
-    currentPriceX10 = ord1.price;
-    
-    if (ord1.vol > ord2.vol)
-	{
-        ord1.vol = ord1.vol - ord2.vol;
-        volume = ord2.vol;
-        queueDel(q2, &trash);
-        pthread_cond_signal(q2->notFull);
-    }
-    else if(ord1.vol < ord2.vol)
-	{
-        ord2.vol = ord2.vol - ord1.vol;
-        volume = ord1.vol;
-        heapDel(q1, &trash);
-        pthread_cond_signal(q1->notFull);
-    }
-    else 
+/******************** Dispatch function ********************/
+void dispatch(order *batch, int n)
+{
+	/*************************************************************************/
+	/* Moves a batch of orders from the arrival queue to our queues. The     */
+	/* orders bound for the same queue or book side are moved together,      */
+	/* under one lock and with one wakeup, in their arrival order. Cancels   */
+	/* are moved after everything else, so one never overtakes the order it  */
+	/* cancels. A shard takes its cancels with its orders instead: its       */
+	/* worker handles them in ring order, which keeps the arrival order.     */
+	/*************************************************************************/
+	
+    char done[RINGBATCH] = {0};
+    order group[RINGBATCH];
+    int i, j, k, pass, dest;
+    
+    for (pass = 0; pass < 2; pass++)
 	{
-        volume = ord1.vol;
-        queueDel(q2, &trash);
-        pthread_cond_signal(q2->notFull);
-        heapDel(q1, &trash);
-        pthread_cond_signal(q1->notFull);
+        for (i = 0; i < n; i++)
+		{
+            if (done[i] || (!sequencer && (batch[i].type == 'C') != pass))
+                continue;
+            
+			// gather the orders of this destination from here on
+            dest = destOf(&batch[i]);
+            for (j = i, k = 0; j < n; j++)
+			{
+                if (!done[j] && destOf(&batch[j]) == dest && (sequencer || batch[j].symbol == batch[i].symbol))
+				{
+                    group[k++] = batch[j];
+                    done[j] = 1;
+                }
+            }
+            
+            // Shards are owned by the sequencer workers, which do the rest
+            if (sequencer)
+                spscPut(shard_q[dest], group, k);
+            else
+                routeGroup(markets[batch[i].symbol], dest, group, k);
+        }
     }
-    trace(getTimestamp(), currentPriceX10, ord1, ord2, volume);
-	dispOrder (trash); fflush(stdout);
 }
 
-/********** Buy Limit - Sell Limit transaction**********/
-void LLtrans (queue *q1, queue *q2) 
+/******************** Destination of an order function ********************/
+int destOf(const order *ord)
 {
-    int volume = 0;
-    order trash,ord1,ord2;
+    if (sequencer)
+        return (ord->symbol % workers);
     
-    ord1 = q1->item[1];
-    ord2 = q2->item[1];
-    currentPriceX10 = (ord1.price + ord2.price)/2;
-    
-    if (ord1.vol > ord2.vol)
+    return (queueOf(ord));
+}
+
+/******************** Queue or book side of an order function ********************/
+int queueOf(const order *ord)
+{
+    switch (ord->type)
 	{
-        ord1.vol = ord1.vol - ord2.vol;
-        volume = ord2.vol;
-        heapDel(q2, &trash);
-        pthread_cond_signal(q2->notFull);
+        case 'M': return ((ord->action == 'B') ? DEST_BM : DEST_SM);
+        case 'L':
+        case 'I': return ((ord->action == 'B') ? DEST_BL : DEST_SL);
+        case 'C': return (DEST_CANCEL);
+        case 'S':
+        case 'T': return (DEST_STOP);
+        default : return (-1);
     }
-    else if(ord1.vol < ord2.vol)
+}
+
+/******************** Route a group of orders function ********************/
+void routeGroup(market *m, int dest, order *group, int k)
+{
+	// signal appropriate handler to deal with them
+    switch (dest)
 	{
-        ord2.vol = ord2.vol - ord1.vol;
-        volume = ord1.vol;
-        heapDel(q1, &trash);
-        pthread_cond_signal(q1->notFull);
+        case DEST_BM: routeQueue(m, m->bm_q, group, k, 1, "Buy Market Queue"); break;
+        case DEST_SM: routeQueue(m, m->sm_q, group, k, 1, "Sell MarketFIFO"); break;
+        case DEST_BL: routeBook(m, m->bl_q, group, k, "Buy Limit Queue"); break;
+        case DEST_SL: routeBook(m, m->sl_q, group, k, "Sell Limit Queue"); break;
+        case DEST_CANCEL: routeQueue(m, m->cancel_q, group, k, 0, "Cancel Queue"); break;
+        case DEST_STOP: routeStops(m, group, k); break;
+        default : break;
     }
-    else 
+}
+
+/******************** Route orders to a queue function ********************/
+void routeQueue(market *m, queue *q, order *group, int k, int indexed, const char *name)
+{
+    int i, spins;
+    
+    lockTake(q->mut);
+    for (i = 0; i < k; i++)
 	{
-        volume = ord1.vol;
-        heapDel(q2, &trash);
-        pthread_cond_signal(q2->notFull);
-        heapDel(q1, &trash);
-        pthread_cond_signal(q1->notFull);
+		// a full market queue may only drain through the orders behind this
+		// one, so waiting could stall Cons for good; the cancel queue always drains
+        if (indexed && q->full)
+		{
+            routeReject(&group[i], name);
+            continue;
+        }
+        for (spins = 0; q->full; spins++)
+		{
+			// wake the handler first, it may be waiting for the orders added so far
+            if (spins == 0) { printf ("*** %s is FULL.\n", name); fflush(stdout); }
+            pthread_cond_signal(q->notEmpty);
+            waitOn(q->notFull, q->mut, spins, 0);
+        }
+        if (indexed)
+            indexAdd(m->index, group[i].id, q, NULL, queueAdd(q, group[i]));
+        else
+            queueAdd(q, group[i]);
     }
-    trace(getTimestamp(), currentPriceX10, ord1, ord2, volume);
-	dispOrder (trash); fflush(stdout);
+    lockGive(q->mut);
+    pthread_cond_signal(q->notEmpty);
 }
 
-/******************** Trace function ********************/
-void trace(long timestamp, int price, order ord1, order ord2, int volume)
+/******************** Route orders to a book side function ********************/
+void routeBook(market *m, book *b, order *group, int k, const char *name)
 {
-	// write current price  to appropriate file 
-    fprintf(sharePrice, "%5.1f\n", (float) price/10.0); fflush(sharePrice);
+	// a full book side only makes room for the orders and cancels behind
+	// these, so an order past the capacity is turned away, not waited for
+    int i;
     
-	// write the desired values to trace file
-	fprintf(trace_file,"%08ld  %5.1f  %4d  %08ld  %c  %08ld  %c\n", timestamp, (float) price/10.0, volume, ord1.id, ord1.type, ord2.id, ord2.type); fflush(trace_file);
-	//fprintf(times,"%08ld\n", timestamp-ord1.timestamp); fflush(times);
+    lockTake(b->mut);
+    for (i = 0; i < k; i++)
+	{
+        if (b->full)
+            routeReject(&group[i], name);
+        else
+            indexAdd(m->index, group[i].id, NULL, b, bookInsert(b, group[i]));
+    }
+    lockGive(b->mut);
+    pthread_cond_signal(b->notEmpty);
 }
 
-/******************** Order generator ********************/
-order makeOrder()
+/******************** Reject an order function ********************/
+void routeReject(const order *ord, const char *name)
 {
-    int magnitude = 10;
-    static int count = 0;
-    order ord;
-    
-    int waitmsec = ((double)rand() / (double)RAND_MAX * magnitude);
-    usleep(waitmsec*1000);
+	// the gateway's client already has its acknowledgement, the reject goes
+	// by engine id without the reference, as that of a cancel does
+    order rec;
     
-    ord.id = count++;
-    ord.timestamp = getTimestamp();
-    
-    // Buy or Sell
-    ord.action = ((double)rand()/(double)RAND_MAX <= 0.5) ? 'B' : 'S';
-    
-    // Order type
-    double u2 = ((double)rand()/(double)RAND_MAX);
-    if (u2 < 0.4)
+    atomic_fetch_add(&rejected, 1);
+    if (verbose) { printf ("*** %s is FULL, order %ld rejected.\n", name, ord->id); fflush(stdout); }
+    if (gate != NULL)
 	{
-        ord.type = 'M';                 // Market order
-        ord.vol = (1 + rand()%50)*100;
-        
+        rec = *ord;
+        rec.type = GW_REJECT;
+        rec.oldid = ord->id;
+        rec.timestamp = 0;
+        gatewayReport(&rec, 1);
     }
-	else if (0.4 <= u2 && u2 < 0.9)
+}
+
+/******************** Sequencer function ********************/
+void* Seq(void *arg)
+{
+	/*************************************************************************/
+	/* Single-threaded engine: one pinned thread takes the input stream in   */
+	/* order and does all the routing, matching and cancels inline, so no    */
+	/* locks are taken and a run is reproducible for a given seed.           */
+	/*************************************************************************/
+	
+    journal *j = order_journal;
+    const order *batch;
+    order stamped[RINGBATCH];
+    long now;
+    int i, n;
+    
+    seqPin(seqCore);
+    while ((n = nextOrders((generator *) arg, &batch, RINGBATCH)) > 0)
 	{
-        ord.type = 'L';                 // Limit order
-        ord.vol = (1 + rand()%50)*100;
+        if (j == NULL)
+		{
+            seqDispatch(batch, n);
+            continue;
+        }
         
-        pthread_mutex_lock(&lock_transaction);
-        ord.price = currentPriceX10 + 10*(0.5 -((double)rand()/(double)RAND_MAX));
-        pthread_mutex_unlock(&lock_transaction);
+		// journal the orders, and go on with those already durable; wait
+		// for the writer only once the journal is full, or with the gateway
+		// for all of it, as its clients may wait for their acknowledgements
+        now = getNanos();
+        memcpy(stamped, batch, n * sizeof (order));
+        for (i = 0; i < n; i++)
+            stamped[i].enqueued = now;
+        journalAppend(j, stamped, n);
+        while ((n = journalTake(j, stamped, RINGBATCH, journalRoom(j) < RINGBATCH || (gate != NULL && journalPending(j)))) > 0)
+            seqDispatch(stamped, n);
     }
-    else if (0.9 <= u2)
+    
+	// the rest goes on once it is durable
+    while (j != NULL && journalPending(j))
 	{
-        ord.type = 'C';                 // Cancel order
-        ord.oldid = ((double)rand()/(double)RAND_MAX)*count;
+        n = journalTake(j, stamped, RINGBATCH, 1);
+        seqDispatch(stamped, n);
     }
-    //dispOrder(ord);
-    return (ord);
+    streamEnded();
+    printf ("*** End of the order stream.\n"); fflush(stdout);
+    return (NULL);
 }
 
-/******************** Get time function ********************/
-long getTimestamp()
+/******************** Sequencer dispatch function ********************/
+void seqDispatch(const order *batch, int n)
 {
-    gettimeofday(&endwtime, NULL);
+    order ord;
+    int i;
     
-    return((double)((endwtime.tv_usec - startwtime.tv_usec)/1.0e6
-                    + endwtime.tv_sec - startwtime.tv_sec)*1000);
-}
-
-/******************** Display order function ********************/
-void dispOrder(order ord)
-{
-    printf("%08ld ", ord.id);
-    printf("%08ld ", ord.timestamp);
-    switch( ord.type )
+    if (gate != NULL)
+        gatewayAck(batch, n);
+    for (i = 0; i < n; i++)
 	{
-        case 'M':
-            printf("%c ", ord.action);
-            printf("Market (%4d)        ", ord.vol); 
-			break;
-            
-        case 'L':
-            printf("%c ", ord.action);
-            printf("Limit  (%4d,%5.1f) ", ord.vol, (float) ord.price/10.0); 
-			break;
-            
-        case 'C':
-            printf("* Cancel  %6ld        ", ord.oldid); 
-			break;
-        default : break;
+		// there is no queue in between, the order is dispatched as it enters
+        ord = batch[i];
+        ord.dispatched = getNanos();
+        if (order_journal == NULL && gate == NULL)
+            ord.enqueued = ord.dispatched;
+        seqProcess(markets[ord.symbol], ord);
     }
-    printf("\n");
+    streamTaken(batch, n);
 }
 
-/******************** Queue initilization function ********************/
-queue *queueInit (void)
+/******************** Sequencer worker function ********************/
+void* Worker(void *arg)
 {
-    queue *q;
-    
-    q = (queue *)malloc (sizeof (queue));
-    if (q == NULL) return (NULL);
-    
-	q->size = 0;	//used for heaps(priority queues)
-    q->empty = 1;
-    q->full = 0;
-    q->head = 0;
-    q->tail = 0;
-    q->mut = (pthread_mutex_t *) malloc (sizeof (pthread_mutex_t));
-    pthread_mutex_init (q->mut, NULL);
-    q->notFull = (pthread_cond_t *) malloc (sizeof (pthread_cond_t));
-    pthread_cond_init (q->notFull, NULL);
-    q->notEmpty = (pthread_cond_t *) malloc (sizeof (pthread_cond_t));
-    pthread_cond_init (q->notEmpty, NULL);
+	/*************************************************************************/
+	/* One shard of the sequencer: owns the symbols routed to its ring and   */
+	/* shares nothing with the other workers, so it runs without locks.    */
+	/*************************************************************************/
 	
-    return (q);
+    int w = (long) arg;
+    order batch[RINGBATCH];
+    int i, n, s;
+    
+    seqPin(seqCore + w);
+    while(1)
+	{
+        n = spscTake(shard_q[w], batch, RINGBATCH);
+        for (i = 0; i < n; i++)
+		{
+            if (batch[i].type == 'E')
+                return (NULL);
+            if (batch[i].type == 'A')
+			{
+				// a call phase starts or ends on all of our symbols
+                for (s = w; s < nsymbols; s += workers)
+                    auctionMarket(markets[s], batch[i].action);
+                continue;
+            }
+            seqProcess(markets[batch[i].symbol], batch[i]);
+        }
+    }
+    return (NULL);
 }
 
-/******************** Delete queue function ********************/
-void queueDelete (queue *q)
+/******************** Pin the calling thread to a core ********************/
+void seqPin(int core)
 {
-    pthread_mutex_destroy (q->mut);
-    free (q->mut);
-    pthread_cond_destroy (q->notFull);
-    free (q->notFull);
-    pthread_cond_destroy (q->notEmpty);
-    free (q->notEmpty);
-    free (q);
+    cpu_set_t cpus;
+    
+    CPU_ZERO(&cpus);
+    CPU_SET(core, &cpus);
+    if (pthread_setaffinity_np(pthread_self(), sizeof (cpus), &cpus) != 0)
+	{
+        printf ("*** Could not pin the sequencer to core %d.\n", core); fflush(stdout);
+    }
 }
 
-/******************** Add order to queue function ********************/
-void queueAdd (queue *q, order in)
+/******************** Thread placement parsing function ********************/
+int placeParse(const char *spec)
 {
-    q->item[q->tail] = in;
-    q->tail++;
-    if (q->tail == QUEUESIZE)
-        q->tail = 0;
-    if (q->tail == q->head)
-        q->full = 1;
-    q->empty = 0;
+	// role=core pairs, comma separated; returns -1 on an unknown role or a bad core
+    char buf[256], *item, *save, *eq, *end;
+    int role, core;
     
-    return;
+    if (strlen(spec) >= sizeof (buf))
+        return (-1);
+    strcpy(buf, spec);
+    for (item = strtok_r(buf, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save))
+	{
+        eq = strchr(item, '=');
+        if (eq == NULL)
+            return (-1);
+        *eq = '\0';
+        for (role = 0; role < NROLES && strcmp(item, roleName[role]) != 0; role++);
+        core = strtol(eq + 1, &end, 10);
+        if (role == NROLES || end == eq + 1 || *end != '\0' || core < 0 || core >= CPU_SETSIZE)
+            return (-1);
+        roleCore[role] = core;
+    }
+    return (0);
 }
 
-/*************** Delete order from queue function***************/
-void queueDel (queue *q, order *out)
+/******************** NUMA node of a core function ********************/
+int cpuNode(int core)
 {
-    *out = q->item[q->head];
-    
-    q->head++;
-    if (q->head == QUEUESIZE)
-        q->head = 0;
-    if (q->head == q->tail)
-        q->empty = 1;
-    q->full = 0;
+	// sysfs links each cpu to its node; -1 for none, or a machine without NUMA
+    char path[64];
+    struct dirent *e;
+    DIR *d;
+    int node = -1;
     
-    return;
+    if (core < 0)
+        return (-1);
+    sprintf(path, "/sys/devices/system/cpu/cpu%d", core);
+    d = opendir(path);
+    if (d == NULL)
+        return (-1);
+    while ((e = readdir(d)) != NULL && node < 0)
+        if (strncmp(e->d_name, "node", 4) == 0 && e->d_name[4] >= '0' && e->d_name[4] <= '9')
+            node = atoi(e->d_name + 4);
+    closedir(d);
+    return (node);
 }
 
-/*************** Insert order to priority queue (heap) function ( O(logN) time )***************/
-void heapInsert(queue *q, order ord)
+/******************** Create a thread of a role function ********************/
+void roleCreate(pthread_t *t, int role, void *(*fn)(void *), void *arg)
 {
 	/*************************************************************************/
-	/* Insert new element into the heap, at the next available slot("hole")  */
-	/* 	   - maintaining a complete binary tree			                     */
-	/* Then, "percolate" the element up the heap, while heap-order property  */
-	/* doesn't meet criteria.                                                */
+	/* The thread starts on the core of its role, if it has one, and under  */
+	/* SCHED_FIFO with -f. Without the privilege for SCHED_FIFO it runs     */
+	/* under the default policy, and without its core wherever the         */
+	/* scheduler puts it; either is said once.                             */
 	/*************************************************************************/
 	
-    int hole;
-    order temp;
+    static int warned = 0;
+    pthread_attr_t attr;
+    struct sched_param param;
+    cpu_set_t cpus;
+    int err;
     
-	//percolate up
-    hole = ++q->size;
-    
-	//insert to min heap
-	if (ord.action == 'B')
+    if (roleCore[role] < 0 && fifoPriority <= 0)
+	{
+        pthread_create(t, NULL, fn, arg);
+        return;
+    }
+    pthread_attr_init(&attr);
+    if (roleCore[role] >= 0)
+	{
+        CPU_ZERO(&cpus);
+        CPU_SET(roleCore[role], &cpus);
+        pthread_attr_setaffinity_np(&attr, sizeof (cpus), &cpus);
+    }
+    if (fifoPriority > 0)
+	{
+        pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+        pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+        param.sched_priority = fifoPriority;
+        pthread_attr_setschedparam(&attr, &param);
+    }
+    err = pthread_create(t, &attr, fn, arg);
+    if (err != 0 && fifoPriority > 0)
 	{
-		for (;hole>1 && ord.price>q->item[hole/2].price;hole/=2)
+        if (!(warned & 1))
 		{
-			q->item[hole]=q->item[hole/2];
+            printf ("*** Could not run the threads under SCHED_FIFO %d: %s.\n", fifoPriority, strerror(err)); fflush(stdout);
         }
+        warned |= 1;
+        pthread_attr_setinheritsched(&attr, PTHREAD_INHERIT_SCHED);
+        err = pthread_create(t, &attr, fn, arg);
     }
-	
-	//insert to max heap
-    else
+    if (err != 0)
 	{
-		for (;hole>1 && ord.price<q->item[hole/2].price;hole/=2)
+        if (!(warned & (2 << role)))
 		{
-			q->item[hole]=q->item[hole/2];
+            printf ("*** Could not pin the %s threads to core %d.\n", roleName[role], roleCore[role]); fflush(stdout);
         }
+        warned |= 2 << role;
+        pthread_create(t, NULL, fn, arg);
     }
-	q->item[hole] = ord;
-	
-    if (q->size == QUEUESIZE)
-        q->full = 1;
-    q->empty = 0;
+    pthread_attr_destroy(&attr);
 }
 
-/*************** Delete order from heap function***************/
-void heapDel (queue *q, order *out)
+/******************** Sequencer order processing function ********************/
+void seqProcess(market *m, order ord)
 {
-    /***********************************************************************/
-	/* Minimum element is always at the root                               */
-	/* Heap decreases by one in size                                       */
-	/* Move last element into hole at the root                             */
-	/* Percolate down while heap-order property not satisfied              */
-	/***********************************************************************/
-	
-    *out = q->item[1];
-	//q->item[1] is the minimum/maximum element
-    q->item[1] = q->item[q->size--];
-    
-    int child,hole;
-    order temp;
-	hole = 1;
-	temp=q->item[hole];
-    if (out->action == 'B') 
-	{
-		// max heap
-		// percolate down
-        for(;hole*2<=q->size;hole=child) 
-		{
-			// left child=hole*2, right child=hole*2+1
-            child = hole*2;
-            
-            if(child!=q->size && q->item[child].price < q->item[child+1].price)
-			{
-                 child++;
-            }
-			// pick child to swap with
-            if(q->item[child].price<temp.price) 
-			{
-                q->item[hole]=q->item[child];
-            }
-            else
-                break;
-        }
-        
-    } 
-	else
+    indexEntry loc;
+    int found;
+    
+    if (ord.type == 'C')
 	{
-        // min heap 
-		for(;hole*2<=q->size;hole=child)
+        found = indexFind(m->index, ord.oldid, &loc) && indexDel(m->index, ord.oldid);
+        if (found)
 		{
-			// left child=hole*2, right child=hole*2+1
-            child = hole*2;
-            
-            if(child!=q->size && q->item[child].price > q->item[child+1].price)
-			{
-                 child++;
-            }
-			// pick child to swap with
-            if(q->item[child].price>temp.price) 
-			{
-                q->item[hole]=q->item[child];
-            }
-            else
-                break;
+            orderUnlink(&loc);
+            if (verbose) printf("Canceled\n");
         }
+        else if (verbose)
+            printf("Not Found\n");
+        if (gate != NULL)
+            gatewayCancel(&ord, found);
+        if (verbose) fflush(stdout);
+        return;
     }
-	q->item[hole]=temp;
-    if (q->size == 0)
-        q->empty = 1;
-    q->full = 0;
+    seqPlace(m, ord);
+    
+    // Match until no transaction is possible, unless the market is in a call,
+    // with the stops the trades set off coming in behind
+    do
+        while (!m->auction && seqMatch(m));
+    while (stopsRoute(m) > 0);
 }
 
-/*************** Try a cancel thread ***************/
-void *CancelTry()
+/******************** Sequencer order placing function ********************/
+void seqPlace(market *m, order ord)
 {
-    order ord;
-    long id;
-    
-    while(1) 
+    switch (ord.type)
 	{
-        pthread_mutex_lock(cancel_q->mut);
-        while(cancel_q->empty)
+        case 'M':
 		{
-            //  printf("*** Cancel Order Queue is Empty.\n");
-            pthread_cond_wait(cancel_q->notEmpty, cancel_q->mut);
+            if (ord.action == 'B')
+			{
+                indexAdd(m->index, ord.id, m->bm_q, NULL, queueAdd(m->bm_q, ord));
+            }
+            else
+			{
+                indexAdd(m->index, ord.id, m->sm_q, NULL, queueAdd(m->sm_q, ord));
+            }
+            break;
         }
-        queueDel(cancel_q, &ord);
-        pthread_mutex_unlock(cancel_q->mut);
-        pthread_cond_signal (cancel_q->notFull);
-        
-        id = ord.oldid;
-            
-        // Search everywhere for the id to be cancelled
-        if( queueSearch(bm_q,id) )
+        case 'L':
+        case 'I':
 		{
-            printf("Canceled\n"); 
-			fflush(stdout);
-		}	
-        else if( queueSearch(sm_q,id) )
-        {
- 	 		printf("Canceled\n");
- 			fflush(stdout);
-		}
-        else if( heapSearch(bl_q,id) )
-        {
-    		printf("Canceled\n");
-	 		fflush(stdout);
-		}        
-		else if( heapSearch(sl_q,id) )
-        {
-   			printf("Canceled\n");
- 			fflush(stdout);
+            if (ord.action == 'B')
+                indexAdd(m->index, ord.id, NULL, m->bl_q, bookInsertSide(m->bl_q, ord, 'B'));
+            else
+                indexAdd(m->index, ord.id, NULL, m->sl_q, bookInsertSide(m->sl_q, ord, 'S'));
+            break;
         }
-		else
-        {    
-			printf("Not Found\n");
-			fflush(stdout);
-		}
+        case 'S':
+        case 'T':
+            stopAdd(m, ord);
+            break;
+        default : break;
     }
-    return;
 }
 
-/******************** Search id in a queue function ********************/
-int queueSearch(queue *q,long id)
+/******************** Sequencer matching function ********************/
+int seqMatch(market *m)
 {
-    int i;
-    
-    for (i = q->head; i != q->tail ; i = (i+1)%QUEUESIZE)
-	{
-        if (q->item[i].id == id)
-		{
-            pthread_mutex_lock( q->mut );
-            queueExtract(q,i);
-            pthread_mutex_unlock(q->mut);
-            pthread_cond_signal(q->notFull);
-            return (1);
-        }
-    }
-    return (0);
+	/*************************************************************************/
+	/* Apply the rules of the four triers in a fixed order, each one firing  */
+	/* a single transaction. Returns 0 when none of them applies.            */
+	/*************************************************************************/
+	
+    return ((!m->bm_q->empty && (seqTry(m, 'B', 'M', 'L', BMLtrans) || seqTry(m, 'B', 'M', 'M', BMMtrans)))
+            || (!m->sm_q->empty && seqTry(m, 'S', 'M', 'L', SMLtrans))
+            || (!m->bl_q->empty && (seqTry(m, 'B', 'L', 'M', BLMtrans) || seqTry(m, 'B', 'L', 'L', BLLtrans)))
+            || (!m->sl_q->empty && seqTry(m, 'S', 'L', 'M', SLMtrans)));
 }
 
-/******************** Search id in a heap function ********************/
-int heapSearch( queue *q,long id)
+/******************** Sequencer transaction function ********************/
+SPECIALIZED int seqTry(market *m, const char side, const char type1, const char type2, void (*trans)(market *))
 {
-    int i;
-    
-    for (i = 1; i <=q->size ; i++)
-	{
-        if (q->item[i].id == id)
-		{
-            pthread_mutex_lock(q->mut);
-            heapExtract(q,i);
-            pthread_mutex_unlock(q->mut);
-            pthread_cond_signal(q->notFull);
-            return (1);
-        }
-    }
-    return (0);
+    if (!tradeReady(m, side, type1, type2))
+        return (0);
+    trans(m);
+    return (1);
+}
+
+/******************** Threads-triers ********************/
+
+/********** Try a Buy Market transaction**********/
+void* BMTry(void *arg)
+{
+    trierRun((market *) arg, 'B', 'M', BMLtrans, BMMtrans);
+    return (NULL);
+}
+
+/********** Try a Sell Market transaction**********/
+void* SMTry(void *arg)
+{
+    trierRun((market *) arg, 'S', 'M', SMLtrans, SMMtrans);
+    return (NULL);
+}
+
+/********** Try a Buy Limit transaction**********/
+void* BLTry(void *arg)
+{
+    trierRun((market *) arg, 'B', 'L', BLMtrans, BLLtrans);
+    return (NULL);
+}
+
+/********** Try a Sell Limit transaction**********/
+void* SLTry(void *arg)
+{
+    trierRun((market *) arg, 'S', 'L', SLMtrans, SLLtrans);
+    return (NULL);
 }
 
-/******************** Extract order in 'index' position from a queue function ********************/
-void queueExtract( queue *q, long index)
+/********** Trier loop of one side and order type **********/
+SPECIALIZED void trierRun(market *m, const char side, const char type, void (*first)(market *), void (*second)(market *))
 {
-    int j;
+	/*************************************************************************/
+	/* Waits for an order of its own, then trades it with the other side:   */
+	/* a market order with its limit orders first and then its market       */
+	/* orders, a limit order the other way round (first and second). side  */
+	/* and type are constants in each trier above, which gets a loop of its */
+	/* own with the branches on them folded away.                           */
+	/*************************************************************************/
+	
+    queue *q = (type == 'M') ? sideQueue(m, side) : NULL;
+    book *b = (type == 'L') ? sideBook(m, side) : NULL;
+    pthread_mutex_t *mut = (type == 'M') ? q->mut : b->mut;
+    pthread_cond_t *notEmpty = (type == 'M') ? q->notEmpty : b->notEmpty;
+    int done, spins, idle = 0;
     
-    if(q->tail > q->head)
+    loopsInit((type == 'M') ? ((side == 'B') ? ROLE_BM : ROLE_SM) : ((side == 'B') ? ROLE_BL : ROLE_SL), m->symbol);
+    while(running)
 	{
-        for(j = index; j < q->tail-1; j++)
-        {
-			q->item[j] = q->item[j+1];
+        // Wait for an order of our own
+        lockTake(mut);
+        for (spins = 0; (((type == 'M') ? q->empty : b->empty) || m->auction) && running; spins++)
+            waitOn(notEmpty, mut, spins, 0);
+        if (!running)
+		{
+            lockGive(mut);
+            break;
         }
-		q->tail--;
         
-        if (q->tail == q->head)
-            q->empty= 1;
-        q->full = 0;
+        // Try the first transaction and, if it cannot be done, the second
+        done = trierTry(m, side, type, (type == 'M') ? 'L' : 'M', first)
+               || trierTry(m, side, type, type, second);
         
-    }
-	else if (q->head > q->tail)
-	{
-        if (index >= q->head)
-		{
-            for(j = index-1; j >= q->head; j--)
-            {
-				q->item[j+1] = q->item[j];
-            }
-			q->head++;
-            
-            if (q->head == QUEUESIZE)
-                q->head = 0;
-            if (q->head == q->tail)
-                q->empty = 1;
-            q->full = 0;
-        }
-		else
+		// nothing to trade with, the other side's trier may still take the trade
+        if (done == 0)
+            waitOn(notEmpty, mut, idle++, 1);
+        else
 		{
-            for(j = index; j < q->tail-1; j++)
-            {
-				q->item[j] = q->item[j+1];
-            }
-			q->tail--;
+            loopCount(1);
+            idle = 0;
         }
+        lockGive(mut);
+		// the stops the trades set off come in behind them
+        if (done)
+            stopsRoute(m);
     }
 }
 
-
-/******************** Extract order in 'index' position from a heap function ********************/
-void heapExtract(queue *q, long index)
+/********** Try a transaction with the other side's orders of type2 **********/
+SPECIALIZED int trierTry(market *m, const char side, const char type1, const char type2, void (*trans)(market *))
 {
-    order out;
-    
-    out = q->item[index];
-	//q->item[i] is the extracted element
-    q->item[index] = q->item[q->size--];
+	// only if its lock is free, so two triers never wait on each other
+    pthread_mutex_t *mut = (type2 == 'M') ? sideQueue(m, OTHER(side))->mut : sideBook(m, OTHER(side))->mut;
+    int ready;
     
-    int child,hole;
-    order temp;
-	hole = index;
-	temp=q->item[hole];
-    if (out.action == 'B')
+    if (lockTry(mut) != 0)
+        return (0);
+    ready = tradeReady(m, side, type1, type2);
+    if (ready)
 	{
-		// max heap
-		// percolate down
-        for(;hole*2<=q->size;hole=child)
-		{
-			// left child=hole*2, right child=hole*2+1
-            child = hole*2;
-            
-            if(child!=q->size && q->item[child].price < q->item[child+1].price)
-			{
-                 child++;
-            }
-			// pick child to swap with
-            if(q->item[child].price<temp.price)
-			{
-                q->item[hole]=q->item[child];
-            }
-            else
-                break;
+        lockTake(m->lock_transaction);
+        trans(m);
+        lockGive(m->lock_transaction);
+    }
+    lockGive(mut);
+    
+    return (ready);
+}
+
+
+/******************** Transaction functions ********************/
+
+/********** Buy Market - Sell Market transaction**********/
+void BMMtrans(market *m)
+{
+    sweep(m, 'B', 'M', 'M');
+}
+
+/********** Buy Market - Sell Limit transaction**********/
+void BMLtrans(market *m)
+{
+    sweep(m, 'B', 'M', 'L');
+}
+
+/********** Sell Market - Buy Market transaction**********/
+void SMMtrans(market *m)
+{
+    sweep(m, 'S', 'M', 'M');
+}
+
+/********** Sell Market - Buy Limit transaction**********/
+void SMLtrans(market *m)
+{
+    sweep(m, 'S', 'M', 'L');
+}
+
+/********** Buy Limit - Sell Market transaction**********/
+void BLMtrans(market *m)
+{
+    sweep(m, 'B', 'L', 'M');
+}
+
+/********** Buy Limit - Sell Limit transaction**********/
+void BLLtrans(market *m)
+{
+    sweep(m, 'B', 'L', 'L');
+}
+
+/********** Sell Limit - Buy Market transaction**********/
+void SLMtrans(market *m)
+{
+    sweep(m, 'S', 'L', 'M');
+}
+
+/********** Sell Limit - Buy Limit transaction**********/
+void SLLtrans(market *m)
+{
+    sweep(m, 'S', 'L', 'L');
+}
+
+/********** Market orders of one side **********/
+SPECIALIZED queue *sideQueue(market *m, const char side)
+{
+    return ((side == 'B') ? m->bm_q : m->sm_q);
+}
+
+/********** Limit orders of one side **********/
+SPECIALIZED book *sideBook(market *m, const char side)
+{
+    return ((side == 'B') ? m->bl_q : m->sl_q);
+}
+
+/********** Can an order of side and type1 trade with the other side's orders of type2 **********/
+SPECIALIZED int tradeReady(market *m, const char side, const char type1, const char type2)
+{
+	/*************************************************************************/
+	/* The caller holds both sides, or is the sequencer, and side has an    */
+	/* order of type1. A market order only takes limit orders better than   */
+	/* the last price, and two limit orders trade once their prices cross.  */
+	/*************************************************************************/
+	
+    book *other = sideBook(m, OTHER(side));
+    
+    if (type2 == 'M')
+        return (sideQueue(m, OTHER(side))->empty == 0);
+    if (other->empty)
+        return (0);
+    if (type1 == 'M')
+        return (BETTER(OTHER(side), other->best, m->currentPriceX10));
+    return (CROSSES(side, sideBook(m, side)->best, other->best));
+}
+
+/********** Sweep the other side with the first order of one side **********/
+SPECIALIZED int sweep(market *m, const char side, const char type1, const char type2)
+{
+	/*************************************************************************/
+	/* The first order of side (its queue or its book side, by type1) trades */
+	/* with the orders of the other side (by type2) in turn, level by level, */
+	/* until it is filled, the other side runs out or the next price fails   */
+	/* the check tradeReady made for the first fill: limit against limit the */
+	/* prices must cross, and a market order only takes a limit better than  */
+	/* the last price. It all happens under the locks the caller             */
+	/* took once. Both orders of a fill are filled in place, so a remainder  */
+	/* keeps its time priority, and the fills are reported together,         */
+	/* SWEEPBATCH at a time. Returns the number of fills.                    */
+	/*************************************************************************/
+	
+    long picked = getNanos();	// the trier holds both sides from here
+    queue *q1 = (type1 == 'M') ? sideQueue(m, side) : NULL;
+    book *b1 = (type1 == 'L') ? sideBook(m, side) : NULL;
+    queue *q2 = (type2 == 'M') ? sideQueue(m, OTHER(side)) : NULL;
+    book *b2 = (type2 == 'L') ? sideBook(m, OTHER(side)) : NULL;
+    tradeFill f[SWEEPBATCH];
+    orderHot *top1, *top2;
+    int n = 0, fills = 0, volume, left, price, hi = INT_MIN, lo = INT_MAX;
+    
+    do
+	{
+        top1 = (type1 == 'M') ? queueTop(q1) : bookTop(b1);
+        top2 = (type2 == 'M') ? queueTop(q2) : bookTop(b2);
+        
+		// a market order trades at the limit, two limit orders meet halfway
+        if (type1 == 'L' && type2 == 'L')
+            price = (top1->price + top2->price)/2;
+        else if (type1 == 'L' || type2 == 'L')
+            price = (type1 == 'L') ? top1->price : top2->price;
+        else
+            price = m->currentPriceX10;
+        atomic_store_explicit(&m->currentPriceX10, price, memory_order_relaxed);
+        if (price > hi) hi = price;
+        if (price < lo) lo = price;
+        
+        volume = (top1->vol < top2->vol) ? top1->vol : top2->vol;
+        left = top1->vol - volume;
+        f[n].ord1 = *top1; f[n].c1 = (type1 == 'M') ? *queueCold(q1) : *bookCold(b1);
+        f[n].ord2 = *top2; f[n].c2 = (type2 == 'M') ? *queueCold(q2) : *bookCold(b2);
+        f[n].price = price;
+        f[n].vol = volume;
+        fillTopSide(m, q2, b2, volume, OTHER(side), type2);
+        fillTopSide(m, q1, b1, volume, side, type1);
+        fills++;
+        if (++n == SWEEPBATCH)
+		{
+            sweepReport(f, n, picked);
+            n = 0;
+        }
+    } while (left > 0 && !((type2 == 'M') ? q2->empty : b2->empty)
+             && (type2 == 'M' || ((type1 == 'M') ? BETTER(OTHER(side), b2->best, m->currentPriceX10)
+                                                 : CROSSES(side, top1->price, b2->best))));
+    
+    if (n > 0)
+        sweepReport(f, n, picked);
+    
+	// every stop at a price the sweep traded through is set off
+    if (fills > 0 && !sequencer)
+	{
+        stopsLock(m);
+        stopsFire(m, hi, lo);
+        stopsUnlock(m);
+    }
+    else if (fills > 0)
+        stopsFire(m, hi, lo);
+    return (fills);
+}
+
+/********** Report a batch of fills **********/
+void sweepReport(tradeFill *f, int n, long picked)
+{
+    int i;
+    
+    for (i = 0; i < n; i++)
+        stageFill(&f[i].c1, &f[i].c2, picked);
+    trace(getTimestamp(), f, n);
+}
+
+/*************** Fill the first order of a side ***************/
+void fillTop(market *m, queue *q, book *b, int volume)
+{
+	// the market order at the head of q if any, otherwise the top of b
+    if (q != NULL)
+        fillTopSide(m, q, NULL, volume, 'B', 'M');
+    else if (b->side == 'B')
+        fillTopSide(m, NULL, b, volume, 'B', 'L');
+    else
+        fillTopSide(m, NULL, b, volume, 'S', 'L');
+}
+
+/********** Fill the first order of a queue or book side of a known type **********/
+SPECIALIZED void fillTopSide(market *m, queue *q, book *b, int volume, const char side, const char type)
+{
+	// the market order at the head of q if type is 'M', otherwise the top of b, of side
+    orderHot *top = (type == 'M') ? queueTop(q) : bookTop(b);
+    order trash;
+    level *l;
+    
+    if (top->vol > volume)
+	{
+		// partly filled, the rest keeps its place
+        top->vol -= volume;
+        if (type == 'L')
+		{
+            l = &b->lvl[b->best - b->base];
+            l->vol -= volume;
+            if (feed != NULL)
+                feedLevel(b, b->best, l, FEED_CHANGE);
+        }
+        return;
+    }
+    if (type == 'L' && top->type == 'I' && bookCold(b)->hidden > 0)
+	{
+        bookRefill(b);
+        return;
+    }
+    
+    if (type == 'M')
+	{
+        queueDel(q, &trash);
+        pthread_cond_signal(q->notFull);
+    }
+    else
+	{
+        bookDelSide(b, &trash, side);
+        pthread_cond_signal(b->notFull);
+    }
+    indexDel(m->index, trash.id);
+    if (verbose) { dispOrder (trash); fflush(stdout); }
+}
+
+/******************** Trace function ********************/
+void trace(long timestamp, const tradeFill *f, int n)
+{
+	// a batch of fills goes to the trade log and the gateway at once
+    char sym[16] = "";
+    tradeRecord rec[SWEEPBATCH];
+    market *m;
+    int i;
+    
+    if (feed != NULL)
+        for (i = 0; i < n; i++)
+            feedTrade(f[i].ord1.symbol, f[i].price, f[i].vol);
+	// the fills are all of one market; the sequencer shares its bars with the Barkeeper
+    if (bar_file != NULL && n > 0)
+	{
+        m = markets[f[0].ord1.symbol];
+        if (sequencer)
+            lockTake(m->lock_transaction);
+		// the order that came in later initiated the trade
+        for (i = 0; i < n; i++)
+            barTrade(m, timestamp, f[i].price, f[i].vol, (f[i].c1.enqueued > f[i].c2.enqueued) ? f[i].ord1.action : f[i].ord2.action);
+        if (sequencer)
+            lockGive(m->lock_transaction);
+    }
+    if (gate != NULL)
+        gatewayFills(f, n);
+    
+    if (trade_log != NULL)
+	{
+        for (i = 0; i < n; i++)
+		{
+            rec[i].timestamp = timestamp;
+            rec[i].id1 = f[i].c1.id;
+            rec[i].id2 = f[i].c2.id;
+            rec[i].price = f[i].price;
+            rec[i].vol = f[i].vol;
+            rec[i].symbol = f[i].ord1.symbol;
+            rec[i].type1 = f[i].ord1.type;
+            rec[i].type2 = f[i].ord2.type;
+        }
+        tradeLogPut(trade_log, rec, n);
+        return;
+    }
+    
+    for (i = 0; i < n; i++)
+	{
+		// with several symbols every line starts with the symbol
+        if (nsymbols > 1)
+            sprintf(sym, "%04d  ", f[i].ord1.symbol);
+        
+		// write current price  to appropriate file 
+        fprintf(sharePrice, "%s%5.1f\n", sym, (float) f[i].price/10.0);
+        
+		// write the desired values to trace file
+        fprintf(trace_file,"%s%08ld  %5.1f  %4d  %08ld  %c  %08ld  %c\n", sym, timestamp, (float) f[i].price/10.0, f[i].vol, f[i].c1.id, f[i].ord1.type, f[i].c2.id, f[i].ord2.type);
+    }
+    fflush(sharePrice);
+    fflush(trace_file);
+	//fprintf(times,"%08ld\n", timestamp-ord1.timestamp); fflush(times);
+}
+
+/******************** Market data feed open function ********************/
+feedRing *feedOpen(const char *name)
+{
+	/*************************************************************************/
+	/* Creates (or takes over) the shared memory object readers attach to.  */
+	/* All slots start unpublished and the head at 0, so a reader that      */
+	/* attached to an earlier run sees the positions start over.            */
+	/*************************************************************************/
+	
+    feedRing *f;
+    int fd;
+    unsigned long i;
+    
+    fd = shm_open(name, O_CREAT | O_RDWR, 0644);
+    if (fd < 0)
+        return (NULL);
+    if (ftruncate(fd, sizeof (feedRing)) != 0)
+	{
+        close(fd);
+        return (NULL);
+    }
+    f = (feedRing *) mmap(NULL, sizeof (feedRing), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (f == MAP_FAILED)
+        return (NULL);
+    
+    for (i = 0; i < FEEDSIZE; i++)
+        atomic_init(&f->slot[i].seq, 0);
+    atomic_init(&f->head, 0);
+    memcpy(f->magic, FEEDMAGIC, 4);
+    f->version = 1;
+    f->msgSize = sizeof (feedMsg);
+    f->nslots = FEEDSIZE;
+    f->nsymbols = nsymbols;
+    
+    return (f);
+}
+
+/*************** Publish a message on the feed (any thread) ***************/
+void feedPut(feedRing *f, feedMsg *msg)
+{
+	/*************************************************************************/
+	/* Broadcast ring: writers claim positions with a fetch-and-add and      */
+	/* never wait for readers. Each slot is a seqlock holding the position  */
+	/* it was last written for plus one (0 while being written), so a       */
+	/* reader that fell a whole ring behind finds a later position there    */
+	/* and knows it was lapped.                                              */
+	/*************************************************************************/
+	
+    unsigned long pos;
+    feedSlot *s;
+    
+    msg->timestamp = getNanos();
+    pos = atomic_fetch_add_explicit(&f->head, 1, memory_order_relaxed);
+    s = &f->slot[pos & (FEEDSIZE-1)];
+    atomic_store_explicit(&s->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    s->msg = *msg;
+    atomic_store_explicit(&s->seq, pos + 1, memory_order_release);
+}
+
+/*************** Publish a price level change of a book side ***************/
+void feedLevel(book *b, int price, level *l, char kind)
+{
+    feedMsg msg;
+    
+    if (b->triggers)
+        return;
+    msg.price = price;
+    msg.vol = l->vol;
+    msg.orders = l->orders;
+    msg.symbol = b->symbol;
+    msg.kind = kind;
+    msg.side = b->side;
+    feedPut(feed, &msg);
+    
+	// every so many changes the whole side follows, for readers joining late
+    if (++b->sinceSnapshot >= FEEDSNAPSHOT)
+        feedSnapshot(b);
+}
+
+/*************** Publish a snapshot of a book side ***************/
+void feedSnapshot(book *b)
+{
+	// the caller owns the side, so no change can come in between
+    feedMsg msg;
+    int i;
+    
+    msg.symbol = b->symbol;
+    msg.side = b->side;
+    msg.kind = FEED_SNAPSHOT;
+    msg.price = b->empty ? 0 : b->best;
+    msg.vol = 0;
+    msg.orders = 0;
+    for (i = 0; i < b->nlevels; i++)
+        msg.orders += (b->lvl[i].orders > 0);
+    feedPut(feed, &msg);
+    
+    msg.kind = FEED_LEVEL;
+    for (i = 0; i < b->nlevels; i++)
+	{
+        if (b->lvl[i].orders == 0)
+            continue;
+        msg.price = b->base + i;
+        msg.vol = b->lvl[i].vol;
+        msg.orders = b->lvl[i].orders;
+        feedPut(feed, &msg);
+    }
+    b->sinceSnapshot = 0;
+}
+
+/*************** Publish a trade ***************/
+void feedTrade(int symbol, int price, int volume)
+{
+    feedMsg msg;
+    
+    msg.price = price;
+    msg.vol = volume;
+    msg.orders = 0;
+    msg.symbol = symbol;
+    msg.kind = FEED_TRADE;
+    msg.side = '-';
+    feedPut(feed, &msg);
+}
+
+/******************** Call phase switch function ********************/
+void auctionSwitch(char phase)
+{
+	/*************************************************************************/
+	/* Called by the thread that owns the input stream. 'C' starts a call    */
+	/* phase, 'U' uncrosses and goes back to continuous trading, 'X'         */
+	/* uncrosses and leaves the markets closed. The sequencer workers get    */
+	/* it in line with their orders; the triers are held off by the market  */
+	/* locks while it is done and woken up if trading resumes.               */
+	/*************************************************************************/
+	
+    order ord;
+    int i;
+    
+    if (sequencer && workers > 1)
+	{
+        ord.type = 'A';
+        ord.action = phase;
+        for (i = 0; i < workers; i++)
+            spscPut(shard_q[i], &ord, 1);
+        return;
+    }
+    
+    if (!sequencer)
+        marketsLock();
+    for (i = 0; i < nsymbols; i++)
+        auctionMarket(markets[i], phase);
+    if (!sequencer)
+	{
+        marketsUnlock();
+        for (i = 0; i < nsymbols; i++)
+            stopsRoute(markets[i]);
+        if (phase == 'U')
+            wakeTriers();
+    }
+}
+
+/******************** Call phase of a market function ********************/
+void auctionMarket(market *m, char phase)
+{
+    int trades;
+    
+    if (phase == 'C')
+	{
+        m->auction = 1;
+        return;
+    }
+    
+    trades = auctionUncross(m);
+    m->auction = (phase == 'X');
+    printf ("*** %s auction of symbol %d: %d trades at %5.1f.\n", (phase == 'X') ? "Closing" : "Opening",
+            m->symbol, trades, (float) m->currentPriceX10/10.0); fflush(stdout);
+    
+	// the sequencer has no locks to let go of before the stops come in
+    if (sequencer)
+        do
+            while (!m->auction && seqMatch(m));
+        while (stopsRoute(m) > 0);
+}
+
+/******************** Uncross function ********************/
+int auctionUncross(market *m)
+{
+	/*************************************************************************/
+	/* Executes everything that crosses at one price, the one that trades    */
+	/* the most volume (see auctionPrice). Market orders go first, then the  */
+	/* limit orders in price and then time priority, which is the order the  */
+	/* queue heads and book tops come in. Returns the number of trades.      */
+	/*************************************************************************/
+	
+    book *bids = m->bl_q, *asks = m->sl_q;
+    long *demand, *supply, volume, picked = getNanos();
+    tradeFill f[SWEEPBATCH];
+    int lo, hi, price, fill, n = 0, trades = 0;
+    
+	// one price grid covering both book sides
+    lo = (bids->base < asks->base) ? bids->base : asks->base;
+    hi = (bids->base + bids->nlevels > asks->base + asks->nlevels) ? bids->base + bids->nlevels : asks->base + asks->nlevels;
+    demand = (long *) malloc (((long) hi - lo) * sizeof (long));
+    supply = (long *) malloc (((long) hi - lo) * sizeof (long));
+    if (demand == NULL || supply == NULL)
+	{
+        perror("auctionUncross");
+        exit(1);
+    }
+    price = auctionPrice(m, demand, supply, lo, hi - lo, &volume);
+    free(demand);
+    free(supply);
+    if (volume == 0)
+        return (0);
+    
+    atomic_store_explicit(&m->currentPriceX10, price, memory_order_relaxed);
+    while (volume > 0)
+	{
+        if (!m->bm_q->empty)
+		{
+            f[n].ord1 = *queueTop(m->bm_q); f[n].c1 = *queueCold(m->bm_q);
+        }
+        else
+		{
+            f[n].ord1 = *bookTop(bids); f[n].c1 = *bookCold(bids);
+        }
+        if (!m->sm_q->empty)
+		{
+            f[n].ord2 = *queueTop(m->sm_q); f[n].c2 = *queueCold(m->sm_q);
+        }
+        else
+		{
+            f[n].ord2 = *bookTop(asks); f[n].c2 = *bookCold(asks);
         }
         
-    } 
-	else 
+        fill = (f[n].ord1.vol < f[n].ord2.vol) ? f[n].ord1.vol : f[n].ord2.vol;
+        fillTop(m, m->bm_q->empty ? NULL : m->bm_q, bids, fill);
+        fillTop(m, m->sm_q->empty ? NULL : m->sm_q, asks, fill);
+        f[n].price = price;
+        f[n].vol = fill;
+        volume -= fill;
+        trades++;
+        if (++n == SWEEPBATCH || volume == 0)
+		{
+            sweepReport(f, n, picked);
+            n = 0;
+        }
+    }
+    if (trades > 0)
+        stopsFire(m, price, price);
+    
+    return (trades);
+}
+
+/******************** Uncross price function ********************/
+CLONED int auctionPrice(market *m, long *demand, long *supply, int lo, int n, long *volume)
+{
+	/*************************************************************************/
+	/* At each price of the grid, demand is the volume of the market buys    */
+	/* and of the bids at that price or above, supply that of the market     */
+	/* sells and of the asks at that price or below, and min(demand, supply) */
+	/* would trade. The price is the one that trades the most, then leaves   */
+	/* the least imbalance, then is closest to the last price. The passes    */
+	/* over the grid are branch-free min/max over plain arrays, which the    */
+	/* compiler vectorizes. The 64-bit compares need SSE4.2 or AVX2, so it   */
+	/* is also built for AVX2 and the best version is picked at load time.   */
+	/*************************************************************************/
+	
+    book *bids = m->bl_q, *asks = m->sl_q;
+    long buys = 0, sells = 0, best, least, far, d, v, m1;
+    int i, k, price, ref = m->currentPriceX10;
+    
+    for (i = m->bm_q->head; i != -1; i = poolLink(&m->bm_q->pool, i)->next)
+        buys += poolHot(&m->bm_q->pool, i)->vol;
+    for (i = m->sm_q->head; i != -1; i = poolLink(&m->sm_q->pool, i)->next)
+        sells += poolHot(&m->sm_q->pool, i)->vol;
+    
+	// volume resting at each price
+    for (i = 0; i < n; i++)
+        demand[i] = supply[i] = 0;
+    for (i = 0, k = bids->base - lo; i < bids->nlevels; i++)
+        demand[k + i] = bids->lvl[i].vol;
+    for (i = 0, k = asks->base - lo; i < asks->nlevels; i++)
+        supply[k + i] = asks->lvl[i].vol;
+    
+	// cumulative curves
+    demand[n-1] += buys;
+    for (i = n-2; i >= 0; i--)
+        demand[i] += demand[i+1];
+    supply[0] += sells;
+    for (i = 1; i < n; i++)
+        supply[i] += supply[i-1];
+    
+	// most volume traded, then least imbalance among those prices
+    best = 0;
+    for (i = 0; i < n; i++)
+	{
+        v = (demand[i] < supply[i]) ? demand[i] : supply[i];
+        best = (v > best) ? v : best;
+    }
+    *volume = best;
+    if (best == 0)
+        return (ref);
+    least = LONG_MAX;
+    for (i = 0; i < n; i++)
+	{
+        v = (demand[i] < supply[i]) ? demand[i] : supply[i];
+        m1 = -(long) (v != best);	// all ones where less than the most is traded
+        d = ((demand[i] + supply[i] - 2*v) & ~m1) | (LONG_MAX & m1);
+        least = (d < least) ? d : least;
+    }
+    
+	// closest to the last price among those left, the lower one on a tie
+    far = LONG_MAX;
+    for (i = 0; i < n; i++)
+	{
+        v = (demand[i] < supply[i]) ? demand[i] : supply[i];
+        m1 = -(long) (v != best || demand[i] + supply[i] - 2*v != least);
+        d = (lo + i > ref) ? lo + i - ref : ref - lo - i;
+        d = (d & ~m1) | (LONG_MAX & m1);
+        far = (d < far) ? d : far;
+    }
+    i = ref - far - lo;
+    if (i >= 0 && i < n && ((demand[i] < supply[i]) ? demand[i] : supply[i]) == best
+        && demand[i] + supply[i] - 2*best == least)
+        price = ref - far;
+    else
+        price = ref + far;
+    
+    return (price);
+}
+
+/******************** Journal initialization function ********************/
+journal *journalInit(const char *path, long interval, long offset)
+{
+	// the journal is an order file, so it replays with -R like a recording;
+	// after a restart it starts at the snapshot's position, offset
+    journal *j;
+    orderFileHeader hdr;
+    
+    j = (journal *)aligned_alloc (CACHELINE, sizeof (journal));
+    if (j == NULL) return (NULL);
+    
+    j->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (j->fd < 0)
+	{
+        free(j);
+        return (NULL);
+    }
+    memcpy(hdr.magic, ORDERMAGIC, 4);
+    hdr.version = ORDERVERSION;
+    hdr.recordSize = sizeof (order);
+    hdr.nsymbols = nsymbols;
+    hdr.offset = offset;
+    if (write(j->fd, &hdr, sizeof (hdr)) != sizeof (hdr) || fdatasync(j->fd) != 0)
+	{
+        close(j->fd);
+        free(j);
+        return (NULL);
+    }
+    
+    j->tail = j->taken = 0;
+    atomic_init(&j->appended, 0);
+    atomic_init(&j->durable, 0);
+    atomic_init(&j->stop, 0);
+    j->interval = interval;
+    j->syncs = 0;
+    j->mut = (pthread_mutex_t *) malloc (sizeof (pthread_mutex_t));
+    pthread_mutex_init (j->mut, NULL);
+    j->notEmpty = (pthread_cond_t *) malloc (sizeof (pthread_cond_t));
+    pthread_cond_init (j->notEmpty, NULL);
+    j->synced = (pthread_cond_t *) malloc (sizeof (pthread_cond_t));
+    pthread_cond_init (j->synced, NULL);
+    
+    return (j);
+}
+
+/*************** Append accepted orders to the journal (stream owner) ***************/
+void journalAppend(journal *j, const order *batch, int n)
+{
+	// the caller made sure there is room
+    int i;
+    
+    if (n == 0)
+        return;
+    for (i = 0; i < n; i++)
+        j->item[(j->tail + i) & (JOURNALSIZE-1)] = batch[i];
+    j->tail += n;
+    
+    pthread_mutex_lock(j->mut);
+    atomic_store_explicit(&j->appended, j->tail, memory_order_release);
+    pthread_cond_signal(j->notEmpty);
+    pthread_mutex_unlock(j->mut);
+}
+
+/*************** Take durable orders from the journal (stream owner) ***************/
+int journalTake(journal *j, order *out, int max, int wait)
+{
+	/*************************************************************************/
+	/* Hands out up to max of the journaled orders that are on disk, in      */
+	/* their order. If wait is set and orders are pending but none is        */
+	/* durable yet, waits for the writer's next commit.                      */
+	/*************************************************************************/
+	
+    unsigned long durable;
+    int n;
+    
+    durable = atomic_load_explicit(&j->durable, memory_order_acquire);
+    if (wait && durable == j->taken && j->taken != j->tail)
+	{
+        pthread_mutex_lock(j->mut);
+        while ((durable = atomic_load(&j->durable)) == j->taken)
+            pthread_cond_wait(j->synced, j->mut);
+        pthread_mutex_unlock(j->mut);
+    }
+    
+    for (n = 0; n < max && j->taken != durable; n++)
+        out[n] = j->item[j->taken++ & (JOURNALSIZE-1)];
+    
+    return (n);
+}
+
+/*************** Orders the journal can still take ***************/
+int journalRoom(journal *j)
+{
+    return (JOURNALSIZE - (j->tail - j->taken));
+}
+
+/*************** Orders journaled but not handed on yet ***************/
+int journalPending(journal *j)
+{
+    return (j->tail != j->taken);
+}
+
+/******************** Journal writer thread ********************/
+void* Journaler(void *arg)
+{
+	/*************************************************************************/
+	/* Group commit: writes out everything appended since the last commit    */
+	/* and makes it durable with one fdatasync, however many orders that     */
+	/* is, so the syncs per order fall as the load rises. With an interval   */
+	/* it lets each group grow that long first, trading latency for fewer    */
+	/* syncs. A journal that cannot be written stops the simulation: an      */
+	/* order that is not durable must not trade.                             */
+	/*************************************************************************/
+	
+    journal *j = (journal *) arg;
+    unsigned long from, to, end;
+    ssize_t written;
+    size_t len;
+    
+    from = 0;
+    while(1)
 	{
-        // min heap 
-		for(;hole*2<=q->size;hole=child) 
+        pthread_mutex_lock(j->mut);
+        while (atomic_load(&j->appended) == from && !atomic_load(&j->stop))
+            pthread_cond_wait(j->notEmpty, j->mut);
+        pthread_mutex_unlock(j->mut);
+        if (atomic_load(&j->appended) == from)
+            break;
+        
+        if (j->interval > 0)
+            usleep(j->interval);
+        to = atomic_load_explicit(&j->appended, memory_order_acquire);
+        
+		// the group may wrap around the end of the ring
+        while (from != to)
 		{
-			// left child=hole*2, right child=hole*2+1
-            child = hole*2;
-            
-            if(child!=q->size && q->item[child].price > q->item[child+1].price)
+            end = (from | (JOURNALSIZE-1)) + 1;
+            if (end > to)
+                end = to;
+            len = (end - from) * sizeof (order);
+            written = write(j->fd, &j->item[from & (JOURNALSIZE-1)], len);
+            if (written < 0)
 			{
-                child++;
+                perror("journal");
+                exit(1);
             }
-			// pick child to swap with
-            if(q->item[child].price>temp.price) 
+            if ((size_t) written != len)
 			{
-                q->item[hole]=q->item[child];
+                fprintf(stderr, "journal: short write\n");
+                exit(1);
             }
-            else
-                break;
+            from = end;
         }
+        if (fdatasync(j->fd) != 0)
+		{
+            perror("journal");
+            exit(1);
+        }
+        j->syncs++;
+        
+        pthread_mutex_lock(j->mut);
+        atomic_store_explicit(&j->durable, to, memory_order_release);
+        pthread_cond_broadcast(j->synced);
+        pthread_mutex_unlock(j->mut);
     }
-	q->item[hole]=temp;
-    if (q->size == 0)
+    return (NULL);
+}
+
+/******************** Journal close function ********************/
+void journalClose(journal *j, pthread_t writer)
+{
+	// everything appended is durable by now, the writer just has to leave
+    pthread_mutex_lock(j->mut);
+    atomic_store(&j->stop, 1);
+    pthread_cond_signal(j->notEmpty);
+    pthread_mutex_unlock(j->mut);
+    pthread_join(writer, NULL);
+    close(j->fd);
+    
+    printf ("*** Journaled %lu orders in %ld group commits.\n", j->tail, j->syncs); fflush(stdout);
+}
+
+/*************** Add a trade to the bar of its market ( O(1) time ) ***************/
+void barTrade(market *m, long timestamp, int price, int volume, char side)
+{
+	/*************************************************************************/
+	/* Called with the market's transaction lock held, which the sequencer   */
+	/* takes for it too. A trade past the end of the current bar's interval  */
+	/* publishes that bar and starts the next one, if barsDue has not        */
+	/* already; intervals with no trades get no bar.                         */
+	/*************************************************************************/
+	
+    bar *b = &m->bar;
+    long start = timestamp - timestamp % barInterval;
+    
+    if (start != b->start)
+	{
+        if (b->start >= 0)
+            barWrite(m);
+        b->start = start;
+        b->open = b->high = b->low = price;
+        b->trades = 0;
+        b->volume = b->notional = 0;
+        b->buyVolume = b->sellVolume = 0;
+    }
+    if (price > b->high)
+        b->high = price;
+    if (price < b->low)
+        b->low = price;
+    b->close = price;
+    b->trades++;
+    b->volume += volume;
+    b->notional += (long) price * volume;
+    if (side == 'B')
+        b->buyVolume += volume;
+    else
+        b->sellVolume += volume;
+    
+    m->volume += volume;
+    m->notional += (long) price * volume;
+}
+
+/******************** Publish a bar function ********************/
+void barWrite(market *m)
+{
+    bar *b = &m->bar;
+    
+    fprintf(bar_file, "%d,%ld,%.1f,%.1f,%.1f,%.1f,%d,%ld,%.2f,%.2f,%ld,%ld\n", m->symbol, b->start,
+            (float) b->open/10.0, (float) b->high/10.0, (float) b->low/10.0, (float) b->close/10.0,
+            b->trades, b->volume, (double) b->notional/b->volume/10.0, (double) m->notional/m->volume/10.0,
+            b->buyVolume, b->sellVolume);
+}
+
+/******************** Publish the bars due function ********************/
+void barsDue()
+{
+	/*************************************************************************/
+	/* Called by the Barkeeper once an interval is over, so that its bars    */
+	/* are published then, even if no trade comes after them. Trades take    */
+	/* their timestamps under the transaction lock, so once it is held no    */
+	/* trade of the interval can still come in.                              */
+	/*************************************************************************/
+	
+    long now = getTimestamp();
+    market *m;
+    int i, n = 0;
+    
+    for (i = 0; i < nsymbols; i++)
+	{
+        m = markets[i];
+        lockTake(m->lock_transaction);
+        if (m->bar.start >= 0 && m->bar.start + barInterval <= now)
+		{
+            barWrite(m);
+            m->bar.start = -1;
+            n++;
+        }
+        lockGive(m->lock_transaction);
+    }
+    if (n > 0)
+        fflush(bar_file);
+}
+
+/******************** Bar publisher function ********************/
+void* Barkeeper(void *arg)
+{
+	// wakes at the end of every interval of the run's clock, until barsClose
+    struct timespec t;
+    long wait;
+    
+    (void) arg;
+    pthread_mutex_lock(&barMut);
+    while (!barDone)
+	{
+        wait = barInterval - getTimestamp() % barInterval;
+        clock_gettime(CLOCK_REALTIME, &t);
+        t.tv_sec += wait / 1000;
+        t.tv_nsec += (wait % 1000) * 1000000;
+        if (t.tv_nsec >= 1000000000)
+		{
+            t.tv_sec++;
+            t.tv_nsec -= 1000000000;
+        }
+        while (!barDone && pthread_cond_timedwait(&barStop, &barMut, &t) != ETIMEDOUT);
+        if (!barDone)
+            barsDue();
+    }
+    pthread_mutex_unlock(&barMut);
+    return (NULL);
+}
+
+/******************** Bars close function ********************/
+void barsClose(pthread_t t)
+{
+	// every trade is in by now: stop the Barkeeper and publish the bars still open
+    int i;
+    
+    pthread_mutex_lock(&barMut);
+    barDone = 1;
+    pthread_cond_signal(&barStop);
+    pthread_mutex_unlock(&barMut);
+    pthread_join(t, NULL);
+    for (i = 0; i < nsymbols; i++)
+        if (markets[i]->bar.start >= 0)
+            barWrite(markets[i]);
+    fclose(bar_file);
+}
+
+/******************** Trade log initialization function ********************/
+tradeLog *tradeLogInit (const char *path)
+{
+    tradeLog *l;
+    tradeFileHeader hdr;
+    unsigned long i;
+    
+    l = (tradeLog *)aligned_alloc (CACHELINE, sizeof (tradeLog));
+    if (l == NULL) return (NULL);
+    
+    l->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (l->fd < 0)
+	{
+        free(l);
+        return (NULL);
+    }
+    memcpy(hdr.magic, TRADEMAGIC, 4);
+    hdr.version = 1;
+    hdr.recordSize = sizeof (tradeRecord);
+    hdr.nsymbols = nsymbols;
+    if (writeAll(l->fd, &hdr, sizeof (hdr)) != 0)
+	{
+        close(l->fd);
+        free(l);
+        return (NULL);
+    }
+    
+	// slot i is free for the producer that claims position i
+    for (i = 0; i < LOGSIZE; i++)
+        atomic_init(&l->slot[i].seq, i);
+    atomic_init(&l->tail, 0);
+    atomic_init(&l->stop, 0);
+    l->head = 0;
+    
+    return (l);
+}
+
+/*************** Add a trade record to the log (any thread) ***************/
+void tradeLogPut(tradeLog *l, const tradeRecord *rec, int n)
+{
+	/*************************************************************************/
+	/* Bounded multi-producer ring: a producer claims n positions with one   */
+	/* fetch-and-add, fills each slot and publishes it by storing the next   */
+	/* sequence number. It only waits if the writer is a whole ring behind.  */
+	/*************************************************************************/
+	
+    unsigned long pos;
+    logSlot *s;
+    int i;
+    
+    pos = atomic_fetch_add_explicit(&l->tail, n, memory_order_relaxed);
+    for (i = 0; i < n; i++)
+	{
+        s = &l->slot[(pos + i) & (LOGSIZE-1)];
+        while (atomic_load_explicit(&s->seq, memory_order_acquire) != pos + i)
+            cpuRelax();
+        s->rec = rec[i];
+        atomic_store_explicit(&s->seq, pos + i + 1, memory_order_release);
+    }
+}
+
+/******************** Trade log writer thread ********************/
+void* Logger(void *arg)
+{
+	/*************************************************************************/
+	/* Drains the ring into a large buffer and writes it out when it fills   */
+	/* or when the ring runs dry, so the trade path never makes a syscall.   */
+	/*************************************************************************/
+	
+    tradeLog *l = (tradeLog *) arg;
+    char *buf;
+    int used = 0;
+    logSlot *s;
+    
+    buf = (char *) malloc (LOGBUFFER);
+    while(1)
+	{
+        s = &l->slot[l->head & (LOGSIZE-1)];
+        if (atomic_load_explicit(&s->seq, memory_order_acquire) == l->head + 1)
+		{
+            memcpy(buf + used, &s->rec, sizeof (tradeRecord));
+            used += sizeof (tradeRecord);
+            atomic_store_explicit(&s->seq, l->head + LOGSIZE, memory_order_release);
+            l->head++;
+            if (used + sizeof (tradeRecord) <= LOGBUFFER)
+                continue;
+        }
+        
+        if (used > 0)
+		{
+			// a trade log with a hole in it would be misread, better to stop
+            if (writeAll(l->fd, buf, used) != 0)
+			{
+                perror("trades.bin");
+                exit(1);
+            }
+            used = 0;
+        }
+        else if (atomic_load(&l->stop))
+            break;
+        else
+            usleep(1000);
+    }
+    free(buf);
+    return (NULL);
+}
+
+/******************** Write everything function ********************/
+int writeAll(int fd, const void *data, size_t len)
+{
+	// carries on after a short write or a signal; -1 with errno set on an error
+    ssize_t n;
+    
+    while (len > 0)
+	{
+        n = write(fd, data, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return (-1);
+        if (n == 0)
+		{
+            errno = EIO;
+            return (-1);
+        }
+        data = (const char *) data + n;
+        len -= n;
+    }
+    return (0);
+}
+
+/******************** Trade log close function ********************/
+void tradeLogClose(tradeLog *l, pthread_t writer)
+{
+	// every producer is done, the writer leaves once the ring is drained
+    atomic_store(&l->stop, 1);
+    pthread_join(writer, NULL);
+    close(l->fd);
+}
+
+/******************** Order gateway open function ********************/
+gateway *gatewayOpen(const char *addr)
+{
+	/*************************************************************************/
+	/* Listens on unix:path, or on tcp:[host:]port (127.0.0.1 by default),   */
+	/* without blocking, and sets up the epoll set of the gateway thread:    */
+	/* the listening socket and an eventfd the engine writes to when it has  */
+	/* reports for a sleeping gateway. The buffers of a connection slot are  */
+	/* allocated the first time it is used and kept, never per message.      */
+	/*************************************************************************/
+	
+    gateway *gw;
+    struct sockaddr_un un;
+    struct sockaddr_in in;
+    struct epoll_event ev;
+    const char *port;
+    char host[64] = "127.0.0.1";
+    int i, one = 1;
+    
+    gw = (gateway *)aligned_alloc (CACHELINE, sizeof (gateway));
+    if (gw == NULL) return (NULL);
+    memset(gw, 0, sizeof (gateway));
+    
+    if (strncmp(addr, "unix:", 5) == 0)
+	{
+        memset(&un, 0, sizeof (un));
+        un.sun_family = AF_UNIX;
+        if (strlen(addr + 5) >= sizeof (un.sun_path))
+		{
+            errno = ENAMETOOLONG;
+            return (NULL);
+        }
+        strcpy(un.sun_path, addr + 5);
+        unlink(un.sun_path);
+        gw->listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (gw->listenFd < 0 || bind(gw->listenFd, (struct sockaddr *) &un, sizeof (un)) != 0)
+            return (NULL);
+        strcpy(gw->path, un.sun_path);
+    }
+    else if (strncmp(addr, "tcp:", 4) == 0)
+	{
+        port = strrchr(addr, ':') + 1;
+        if (port - addr > 5 && port - addr - 5 < (long) sizeof (host))
+		{
+            memcpy(host, addr + 4, port - addr - 5);
+            host[port - addr - 5] = '\0';
+        }
+        memset(&in, 0, sizeof (in));
+        in.sin_family = AF_INET;
+        in.sin_port = htons(atoi(port));
+        if (inet_pton(AF_INET, host, &in.sin_addr) != 1)
+		{
+            errno = EINVAL;
+            return (NULL);
+        }
+        gw->listenFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (gw->listenFd < 0)
+            return (NULL);
+        setsockopt(gw->listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one));
+        if (bind(gw->listenFd, (struct sockaddr *) &in, sizeof (in)) != 0)
+            return (NULL);
+    }
+    else
+	{
+        errno = EINVAL;
+        return (NULL);
+    }
+    if (listen(gw->listenFd, SOMAXCONN) != 0)
+        return (NULL);
+    
+	// the listener and the wakeup are told apart from the slots by their data
+    gw->epollFd = epoll_create1(0);
+    gw->wakeFd = eventfd(0, EFD_NONBLOCK);
+    if (gw->epollFd < 0 || gw->wakeFd < 0)
+        return (NULL);
+    ev.events = EPOLLIN;
+    ev.data.u64 = GWCONNS;
+    epoll_ctl(gw->epollFd, EPOLL_CTL_ADD, gw->listenFd, &ev);
+    ev.data.u64 = GWCONNS + 1;
+    epoll_ctl(gw->epollFd, EPOLL_CTL_ADD, gw->wakeFd, &ev);
+    
+    for (i = 0; i < GWCONNS; i++)
+        gw->conn[i].fd = -1;
+    gw->seq = 1;
+    atomic_init(&gw->waiting, 0);
+    atomic_init(&gw->stop, 0);
+	// engine threads yield while the ring is full, they never wait for the gateway to park
+    gw->out = mpscInit(1);
+    if (gw->out == NULL)
+        return (NULL);
+    
+    return (gw);
+}
+
+/******************** Order gateway function ********************/
+void* Gateway(void *arg)
+{
+	/*************************************************************************/
+	/* One thread on a non-blocking epoll loop. Each turn handles a batch of */
+	/* events: new connections are accepted, and every whole request read   */
+	/* from a socket is turned into an order on the pending batch, which     */
+	/* then goes to the incoming queue at once. The execution reports the   */
+	/* engine left on the report ring are then copied to their connections, */
+	/* with one write per connection. While the incoming queue is full the  */
+	/* requests stay in their buffers and the connection is not read, so     */
+	/* its socket fills up and holds the client back.                        */
+	/*************************************************************************/
+	
+    gateway *gw = (gateway *) arg;
+    mpscRing *r = gw->out;
+    struct epoll_event ev[GWEVENTS];
+    struct timeval tv = {1, 0};
+    unsigned long wake;
+    gwConn *k;
+    int i, n, c, w, timeout;
+    
+    while (!atomic_load(&gw->stop))
+	{
+		// sleep only with nothing to do; once waiting is set the engine wakes us up
+        timeout = (gw->npend > 0 || gw->nstalled > 0) ? 1 : -1;
+        atomic_store(&gw->waiting, 1);
+        if (atomic_load(&r->slot[r->head & (RINGSIZE-1)].seq) == r->head + 1)
+            timeout = 0;
+        n = epoll_wait(gw->epollFd, ev, GWEVENTS, timeout);
+        atomic_store(&gw->waiting, 0);
+        
+        for (i = 0; i < n; i++)
+		{
+            c = ev[i].data.u64;
+            if (c == GWCONNS)
+                gatewayAccept(gw);
+            else if (c == GWCONNS + 1)
+			{
+                if (read(gw->wakeFd, &wake, sizeof (wake)) < 0)
+                    continue;
+            }
+            else
+			{
+                if (ev[i].events & EPOLLOUT)
+                    gatewayFlush(gw, c);
+                if (ev[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+                    gatewayRead(gw, c);
+            }
+        }
+        gatewayPush(gw);
+        gatewayDrain(gw);
+    }
+    
+	// the engine has stopped: the last reports go out, each client gets a second to take them
+    while (atomic_load(&r->slot[r->head & (RINGSIZE-1)].seq) == r->head + 1)
+        gatewayDrain(gw);
+    for (c = 0; c < GWCONNS; c++)
+	{
+        k = &gw->conn[c];
+        if (k->fd < 0)
+            continue;
+        fcntl(k->fd, F_SETFL, 0);
+        setsockopt(k->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof (tv));
+        for (n = 0; n < k->wlen && (w = send(k->fd, k->wbuf + n, k->wlen - n, MSG_NOSIGNAL)) > 0; n += w);
+        close(k->fd);
+        k->fd = -1;
+    }
+    close(gw->listenFd);
+    close(gw->epollFd);
+    close(gw->wakeFd);
+    if (gw->path[0] != '\0')
+        unlink(gw->path);
+    return (NULL);
+}
+
+/******************** Gateway accept function ********************/
+void gatewayAccept(gateway *gw)
+{
+    struct epoll_event ev;
+    gwConn *k;
+    int fd, c, i, one = 1;
+    
+    while ((fd = accept4(gw->listenFd, NULL, NULL, SOCK_NONBLOCK)) >= 0)
+	{
+		// the next free slot round robin, one still on a list is not free yet
+        for (i = 0, c = gw->nextSlot; i < GWCONNS; i++, c = (c + 1) % GWCONNS)
+            if (gw->conn[c].fd < 0 && !gw->conn[c].stalled && !gw->conn[c].dirty)
+                break;
+        if (i == GWCONNS)
+		{
+            printf ("*** Gateway is full, connection refused.\n"); fflush(stdout);
+            close(fd);
+            continue;
+        }
+        gw->nextSlot = (c + 1) % GWCONNS;
+        
+        k = &gw->conn[c];
+        if (k->rbuf == NULL)
+		{
+            k->rbuf = (char *) malloc (GWBUFFER);
+            k->wbuf = (char *) malloc (GWBUFFER);
+        }
+        k->fd = fd;
+        k->rlen = k->wlen = 0;
+        k->writing = 0;
+        k->first = gw->seq;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+        ev.events = EPOLLIN;
+        ev.data.u64 = c;
+        epoll_ctl(gw->epollFd, EPOLL_CTL_ADD, fd, &ev);
+        gw->conns++;
+    }
+}
+
+/******************** Gateway read function ********************/
+void gatewayRead(gateway *gw, int c)
+{
+    gwConn *k = &gw->conn[c];
+    int n;
+    
+	// a stalled connection is read once its requests have gone on
+    if (k->fd < 0 || k->stalled)
+        return;
+    
+    n = read(k->fd, k->rbuf + k->rlen, GWBUFFER - k->rlen);
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR))
+	{
+        gatewayDrop(gw, c);
+        return;
+    }
+    if (n > 0)
+	{
+        k->rlen += n;
+        gatewayParse(gw, c);
+    }
+}
+
+/******************** Gateway request parsing function ********************/
+void gatewayParse(gateway *gw, int c)
+{
+	/*************************************************************************/
+	/* Turns the whole requests in the read buffer into orders on the        */
+	/* pending batch, until it is full. The order id is the sequence number  */
+	/* times GWCONNS plus the slot, so its reports find the connection.      */
+	/* The client's reference rides in oldid, which a new order has no use  */
+	/* for, up to the acknowledgement.                                       */
+	/*************************************************************************/
+	
+    gwConn *k = &gw->conn[c];
+    gwRequest req;
+    gwReport rep;
+    order *ord;
+    unsigned short len;
+    int used = 0, stalled = 0;
+    
+    while (k->rlen - used >= (int) sizeof (len))
+	{
+        memcpy(&len, k->rbuf + used, sizeof (len));
+        if (len < sizeof (gwRequest) || len > GWMAXMSG)
+		{
+            printf ("*** Gateway: bad request length %d, connection dropped.\n", len); fflush(stdout);
+            gatewayDrop(gw, c);
+            return;
+        }
+        if (k->rlen - used < len)
+            break;
+        if (gw->npend == RINGBATCH)
+		{
+            stalled = 1;
+            break;
+        }
+        memcpy(&req, k->rbuf + used, sizeof (req));
+        used += len;
+        gw->requests++;
+        
+        if (req.kind == GW_END && !gw->ended)
+		{
+            gw->ended = 1;
+            gw->pend[gw->npend++].type = 'E';
+            continue;
+        }
+        if (gw->ended || req.symbol >= nsymbols
+            || (req.kind != GW_ORDER && req.kind != GW_CANCEL)
+            || (req.kind == GW_ORDER && ((req.action != 'B' && req.action != 'S') || req.vol <= 0
+                                         || req.type == '\0' || strchr("MLSTI", req.type) == NULL
+                                         || (req.type != 'M' && req.type != 'S' && !gatewayPrice(req.symbol, req.price))
+                                         || ((req.type == 'S' || req.type == 'T') && !gatewayPrice(req.symbol, req.id))
+                                         || (req.type == 'I' && (req.id <= 0 || req.id > INT_MAX)))))
+		{
+            memset(&rep, 0, sizeof (rep));
+            rep.length = sizeof (rep);
+            rep.kind = GW_REJECT;
+            rep.symbol = req.symbol;
+            rep.id = req.id;
+            rep.ref = req.ref;
+            gatewayPost(gw, c, &rep);
+            if (k->fd < 0)
+                return;
+            continue;
+        }
+        
+        ord = &gw->pend[gw->npend++];
+        ord->id = gw->seq++ * GWCONNS + c;
+        ord->timestamp = ord->enqueued = getNanos();
+        ord->symbol = req.symbol;
+        ord->vol = req.vol;
+        ord->price = (req.type != 'M' && req.type != 'S') ? req.price : 0;
+        ord->aux = (req.kind == GW_ORDER && req.type != 'M' && req.type != 'L') ? (int) req.id : 0;
+        ord->action = req.action;
+        ord->type = (req.kind == GW_CANCEL) ? 'C' : req.type;
+        ord->oldid = (req.kind == GW_CANCEL) ? req.id : req.ref;
+    }
+    memmove(k->rbuf, k->rbuf + used, k->rlen - used);
+    k->rlen -= used;
+    
+	// stop reading a connection whose requests have to wait, and start again once they have gone
+    if (stalled != k->stalled)
+	{
+        k->stalled = stalled;
+        if (stalled)
+            gw->stall[gw->nstalled++] = c;
+        gatewayEvents(gw, c);
+    }
+}
+
+/******************** Gateway hand-off function ********************/
+void gatewayPush(gateway *gw)
+{
+    int i, n, c;
+    
+	// the pending orders go to the incoming queue, as many as it takes
+    if (gw->npend > 0)
+	{
+        n = incomingOffer(gw->pend, gw->npend);
+        memmove(gw->pend, gw->pend + n, (gw->npend - n) * sizeof (order));
+        gw->npend -= n;
+    }
+    
+	// then the stalled connections go on, in the order they stalled
+    for (i = 0, n = 0; i < gw->nstalled; i++)
+	{
+        c = gw->stall[i];
+        if (gw->conn[c].fd >= 0 && gw->npend < RINGBATCH)
+            gatewayParse(gw, c);
+        if (gw->conn[c].fd >= 0 && gw->conn[c].stalled)
+            gw->stall[n++] = c;
+        else
+            gw->conn[c].stalled = 0;
+    }
+    gw->nstalled = n;
+}
+
+/******************** Incoming hand-off without waiting function ********************/
+int incomingOffer(const order *batch, int n)
+{
+	// puts as many of the orders as there is room for, the gateway is the only producer
+    queue *q = (queue *) incoming;
+    int k;
+    
+    if (ingest != INGEST_QUEUE)
+        return (mpscOffer((mpscRing *) incoming, batch, n));
+    
+    lockTake(q->mut);
+    for (k = 0; k < n && !q->full; k++)
+        queueAdd(q, batch[k]);
+    lockGive(q->mut);
+    if (k > 0)
+        pthread_cond_signal(q->notEmpty);
+    
+    return (k);
+}
+
+/******************** Gateway price check function ********************/
+int gatewayPrice(int symbol, long price)
+{
+	// within GWBAND percent of the last price, so no client can stretch the books' price windows
+    long last = atomic_load_explicit(&markets[symbol]->currentPriceX10, memory_order_relaxed);
+    
+    return (price > 0 && price >= last - last * GWBAND / 100 && price <= last + last * GWBAND / 100);
+}
+
+/******************** Gateway report delivery function ********************/
+void gatewayDrain(gateway *gw)
+{
+	// at most a ring of reports per turn, so the reads go on under a stream of fills
+    order rec[RINGBATCH];
+    gwReport rep;
+    int i, n, c, total;
+    
+    memset(&rep, 0, sizeof (rep));
+    rep.length = sizeof (rep);
+    for (total = 0; total < RINGSIZE && (n = mpscPop(gw->out, rec, RINGBATCH)) > 0; total += n)
+	{
+        for (i = 0; i < n; i++)
+		{
+            c = rec[i].id % GWCONNS;
+            if (gw->conn[c].fd < 0 || rec[i].id / GWCONNS < gw->conn[c].first)
+                continue;
+            rep.kind = rec[i].type;
+            rep.symbol = rec[i].symbol;
+            rep.vol = rec[i].vol;
+            rep.price = rec[i].price;
+            rep.id = rec[i].oldid;
+            rep.ref = rec[i].timestamp;
+            gatewayPost(gw, c, &rep);
+        }
+    }
+    
+	// one write per connection for all it got
+    for (i = 0; i < gw->ndirty; i++)
+	{
+        c = gw->dirty[i];
+        gw->conn[c].dirty = 0;
+        gatewayFlush(gw, c);
+    }
+    gw->ndirty = 0;
+}
+
+/******************** Gateway report posting function ********************/
+void gatewayPost(gateway *gw, int c, const gwReport *rep)
+{
+    gwConn *k = &gw->conn[c];
+    
+	// a client that stops reading is dropped rather than holding the engine back
+    if (k->wlen + (int) sizeof (gwReport) > GWBUFFER)
+	{
+        printf ("*** Gateway: connection %d does not take its reports, dropped.\n", c); fflush(stdout);
+        gatewayDrop(gw, c);
+        return;
+    }
+    memcpy(k->wbuf + k->wlen, rep, sizeof (gwReport));
+    k->wlen += sizeof (gwReport);
+    gw->reports++;
+    if (!k->dirty)
+	{
+        k->dirty = 1;
+        gw->dirty[gw->ndirty++] = c;
+    }
+}
+
+/******************** Gateway write function ********************/
+void gatewayFlush(gateway *gw, int c)
+{
+    gwConn *k = &gw->conn[c];
+    int n, writing;
+    
+    if (k->fd < 0)
+        return;
+    if (k->wlen > 0)
+	{
+        n = send(k->fd, k->wbuf, k->wlen, MSG_NOSIGNAL);
+        if (n < 0 && errno != EAGAIN && errno != EINTR)
+		{
+            gatewayDrop(gw, c);
+            return;
+        }
+        if (n > 0)
+		{
+            memmove(k->wbuf, k->wbuf + n, k->wlen - n);
+            k->wlen -= n;
+        }
+    }
+    
+	// what the socket did not take goes once it is writable
+    writing = (k->wlen > 0);
+    if (writing != k->writing)
+	{
+        k->writing = writing;
+        gatewayEvents(gw, c);
+    }
+}
+
+/******************** Gateway events of a connection function ********************/
+void gatewayEvents(gateway *gw, int c)
+{
+    struct epoll_event ev;
+    
+    ev.events = (gw->conn[c].stalled ? 0 : EPOLLIN) | (gw->conn[c].writing ? EPOLLOUT : 0);
+    ev.data.u64 = c;
+    epoll_ctl(gw->epollFd, EPOLL_CTL_MOD, gw->conn[c].fd, &ev);
+}
+
+/******************** Gateway drop connection function ********************/
+void gatewayDrop(gateway *gw, int c)
+{
+	// the slot stays on the stalled and dirty lists until they are next gone through
+    gwConn *k = &gw->conn[c];
+    
+    epoll_ctl(gw->epollFd, EPOLL_CTL_DEL, k->fd, NULL);
+    close(k->fd);
+    k->fd = -1;
+    k->rlen = k->wlen = 0;
+    k->writing = 0;
+}
+
+/******************** Gateway close function ********************/
+void gatewayClose(gateway *gw, pthread_t thread)
+{
+	// called once the engine has stopped, so no more reports come
+    unsigned long one = 1;
+    
+    atomic_store(&gw->stop, 1);
+    if (write(gw->wakeFd, &one, sizeof (one)) < 0)
+        perror("gateway");
+    pthread_join(thread, NULL);
+    printf ("*** Gateway: %ld connections, %ld requests, %ld reports.\n", gw->conns, gw->requests, gw->reports); fflush(stdout);
+}
+
+/******************** Execution report function ********************/
+void gatewayReport(const order *rec, int n)
+{
+	/*************************************************************************/
+	/* Called by any engine thread. Reports go to the gateway as order       */
+	/* records on their own ring: type is the report kind, id the order     */
+	/* whose connection gets it, oldid the id reported and timestamp the     */
+	/* client's reference. The gateway is only woken if it is going to      */
+	/* sleep, it checks the ring once more after saying so.                  */
+	/*************************************************************************/
+	
+    unsigned long one = 1;
+    
+    mpscPut(gate->out, rec, n);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&gate->waiting, memory_order_relaxed))
+	{
+        if (write(gate->wakeFd, &one, sizeof (one)) < 0)
+            perror("gateway");
+    }
+}
+
+/******************** Acknowledge orders function ********************/
+void gatewayAck(const order *batch, int n)
+{
+	// new orders of every type are acknowledged as they are handed on, cancels get their outcome instead
+    order rec[RINGBATCH];
+    int i, k;
+    
+    for (i = 0, k = 0; i < n; i++)
+	{
+        if (batch[i].type == 'C' || queueOf(&batch[i]) == -1)
+            continue;
+        rec[k].type = GW_ACK;
+        rec[k].id = rec[k].oldid = batch[i].id;
+        rec[k].timestamp = batch[i].oldid;
+        rec[k].symbol = batch[i].symbol;
+        rec[k].vol = batch[i].vol;
+        rec[k].price = batch[i].price;
+        k++;
+    }
+    if (k > 0)
+        gatewayReport(rec, k);
+}
+
+/******************** Report fills function ********************/
+void gatewayFills(const tradeFill *f, int n)
+{
+	// both orders of every fill of a batch, in one go
+    order rec[2*SWEEPBATCH];
+    int i;
+    
+    for (i = 0; i < 2*n; i++)
+	{
+        rec[i].type = GW_FILL;
+        rec[i].id = rec[i].oldid = (i % 2 == 0) ? f[i/2].c1.id : f[i/2].c2.id;
+        rec[i].timestamp = 0;
+        rec[i].symbol = f[i/2].ord1.symbol;
+        rec[i].vol = f[i/2].vol;
+        rec[i].price = f[i/2].price;
+    }
+    gatewayReport(rec, 2*n);
+}
+
+/******************** Report a cancel function ********************/
+void gatewayCancel(const order *ord, int found)
+{
+	// goes to the connection of the cancel, about the order it was for
+    order rec;
+    
+    rec.type = found ? GW_CANCELED : GW_REJECT;
+    rec.id = ord->id;
+    rec.oldid = ord->oldid;
+    rec.timestamp = 0;
+    rec.symbol = ord->symbol;
+    rec.vol = rec.price = 0;
+    gatewayReport(&rec, 1);
+}
+
+/******************** Order source function ********************/
+int nextOrders(generator *g, const order **batch, int max)
+{
+	/*************************************************************************/
+	/* Hands out the next orders of the input stream: up to max records     */
+	/* straight from the mapped replay file, the orders of the gateway, or  */
+	/* orders from generator g, which are also recorded when -W is given.   */
+	/* Returns 0 at the end of a replay, once a client of the gateway has   */
+	/* ended the stream, or once a benchmark has generated all its orders.  */
+	/*************************************************************************/
+	
+    int i, n;
+    
+	// the gateway's orders, until a client ends the stream
+    if (gate != NULL)
+	{
+        if (g->limit == 0)
+            return (0);
+        n = consTake(incoming, g->buf, 1);
+        for (i = 0; i < n && g->buf[i].type != 'E'; i++);
+        if (i < n)
+            g->limit = 0;
+        *batch = g->buf;
+        return (i);
+    }
+    if (replay != NULL)
+        return (replayNext(replay, batch, max));
+    
+	// a benchmark generates whole batches, otherwise orders come one at a time
+    if (bench == 0)
+        max = 1;
+    if (g->limit >= 0 && max > g->limit - g->count)
+        max = g->limit - g->count;
+    for (n = 0; n < max; n++)
+        g->buf[n] = makeOrder(g);
+    if (record_file != NULL && n > 0)
+        fwrite(g->buf, sizeof (order), n, record_file);
+    *batch = g->buf;
+    return (n);
+}
+
+/******************** Order file recording function ********************/
+FILE *recordOpen(const char *path, long offset)
+{
+	// the first record is the one at position offset of the input stream
+    FILE *f;
+    orderFileHeader hdr;
+    
+    f = fopen(path, "wb");
+    if (f == NULL) return (NULL);
+    
+    memcpy(hdr.magic, ORDERMAGIC, 4);
+    hdr.version = ORDERVERSION;
+    hdr.recordSize = sizeof (order);
+    hdr.nsymbols = nsymbols;
+    hdr.offset = offset;
+    fwrite(&hdr, sizeof (hdr), 1, f);
+    
+    return (f);
+}
+
+/******************** Order file replay initialization function ********************/
+orderFile *replayOpen(const char *path, int paced)
+{
+    orderFile *f;
+    orderFileHeader *hdr;
+    struct stat st;
+    void *map;
+    int fd;
+    
+    fd = open(path, O_RDONLY);
+    if (fd < 0) return (NULL);
+    if (fstat(fd, &st) != 0 || st.st_size < 0 || (size_t) st.st_size < sizeof (orderFileHeader))
+	{
+        close(fd);
+        return (NULL);
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return (NULL);
+    
+    hdr = (orderFileHeader *) map;
+    if (memcmp(hdr->magic, ORDERMAGIC, 4) != 0 || hdr->version != ORDERVERSION || hdr->recordSize != sizeof (order))
+	{
+        munmap(map, st.st_size);
+        return (NULL);
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    
+    f = (orderFile *) malloc (sizeof (orderFile));
+    f->item = (const order *) (hdr + 1);
+    // a recording cut short ends at its last whole record
+    f->count = ((size_t) st.st_size - sizeof (orderFileHeader)) / sizeof (order);
+    f->next = 0;
+    f->nsymbols = hdr->nsymbols;
+    f->paced = paced;
+    f->start = -1;
+    f->offset = hdr->offset;
+    
+    return (f);
+}
+
+/*************** Next records of a replay (zero-copy) ***************/
+int replayNext(orderFile *f, const order **batch, int max)
+{
+    long now;
+    int n;
+    
+    if (f->next == f->count)
+        return (0);
+    
+    *batch = &f->item[f->next];
+    n = (f->count - f->next < max) ? f->count - f->next : max;
+    
+	// paced replay: release only the records whose recorded time has come
+    if (f->paced)
+	{
+        if (f->start == -1)
+            f->start = getNanos();
+        now = f->item[0].timestamp + getNanos() - f->start;
+        if (f->item[f->next].timestamp > now)
+		{
+            usleep((f->item[f->next].timestamp - now) / 1000);
+            now = f->item[f->next].timestamp;
+        }
+        for (n = 1; n < max && f->next + n < f->count && f->item[f->next + n].timestamp <= now; n++);
+    }
+    
+    f->next += n;
+    return (n);
+}
+
+/*************** Count the orders taken from the input stream ***************/
+void streamTaken(const order *batch, int n)
+{
+	/*************************************************************************/
+	/* Called by the thread that owns the input stream, Seq or Cons, once a  */
+	/* batch has been dispatched. Every order taken so far is then in the    */
+	/* markets or already traded, which is when a snapshot may be taken.     */
+	/*************************************************************************/
+	
+    int i;
+    
+    for (i = 0; i < n; i++)
+        if (batch[i].id >= nextId)
+            nextId = batch[i].id + 1;
+    position += n;
+    
+    if (snapEvery > 0 && position >= snapDue)
+	{
+        snapshotTake();
+        snapDue = position + snapEvery;
+    }
+    
+	// the call phases start and end with the batch that crosses their bounds
+    if (phase == 'O' && position >= auctionOrders)
+	{
+        auctionSwitch('U');
+        phase = 'T';
+    }
+    if (phase == 'T' && closeAt >= 0 && position >= closeAt)
+	{
+        auctionSwitch('C');
+        phase = 'C';
+    }
+}
+
+/*************** End of the input stream ***************/
+void streamEnded()
+{
+	// a call still open is uncrossed, and the markets stay closed
+    if (phase != 'T')
+        auctionSwitch('X');
+}
+
+/******************** Snapshot function ********************/
+void snapshotTake()
+{
+	/*************************************************************************/
+	/* A forked child writes the state out while the engine carries on. The  */
+	/* fork only copies the page tables and copy-on-write keeps the child's  */
+	/* view as it was at the fork, so the triers are only held off by the    */
+	/* market locks for the fork itself. If the last snapshot is still being */
+	/* written this one is skipped.                                          */
+	/*************************************************************************/
+	
+    if (snap_child > 0 && waitpid(snap_child, NULL, WNOHANG) == 0)
+        return;
+    
+    if (!sequencer)
+        marketsLock();
+    snap_child = fork();
+    if (snap_child == 0)
+        _exit(snapshotWrite(SNAPFILE) != 0);
+    if (!sequencer)
+        marketsUnlock();
+    
+    if (snap_child < 0)
+        perror("fork");
+    else if (verbose)
+	{
+        printf ("*** Snapshot at order %ld.\n", position); fflush(stdout);
+    }
+}
+
+/******************** Lock every market function ********************/
+void marketsLock()
+{
+	/*************************************************************************/
+	/* The cancel trier holds the cancel queue while it unlinks an order, so */
+	/* that lock comes first. The triers take a queue lock and try the       */
+	/* others, and only block on lock_transaction; taking them in the same   */
+	/* order, lock_transaction last, cannot deadlock with them. The stop     */
+	/* locks come after it, as the sweeps take them, and stopsRoute moves    */
+	/* the stops that went off under the queue locks and the fired queue's.  */
+	/* So once all are held no order is in flight: every one is in a queue   */
+	/* or book side, or traded. The index keeps its own lock, which is only  */
+	/* ever taken inside these.                                              */
+	/*************************************************************************/
+	
+    int i;
+    market *m;
+    
+    for (i = 0; i < nsymbols; i++)
+	{
+        m = markets[i];
+        lockTake(m->cancel_q->mut);
+        lockTake(m->bm_q->mut);
+        lockTake(m->sm_q->mut);
+        lockTake(m->bl_q->mut);
+        lockTake(m->sl_q->mut);
+        lockTake(m->lock_transaction);
+        stopsLock(m);
+    }
+}
+
+/******************** Unlock every market function ********************/
+void marketsUnlock()
+{
+    int i;
+    market *m;
+    
+    for (i = nsymbols - 1; i >= 0; i--)
+	{
+        m = markets[i];
+        stopsUnlock(m);
+        lockGive(m->lock_transaction);
+        lockGive(m->sl_q->mut);
+        lockGive(m->bl_q->mut);
+        lockGive(m->sm_q->mut);
+        lockGive(m->bm_q->mut);
+        lockGive(m->cancel_q->mut);
+    }
+}
+
+/******************** Snapshot writing function (child process) ********************/
+int snapshotWrite(const char *path)
+{
+	/*************************************************************************/
+	/* Only the forking thread lives on in the child, and the locks may be   */
+	/* held by threads that did not, so it takes none and keeps off stdio.   */
+	/* The file is written aside and renamed over the last snapshot, so     */
+	/* there is always a whole one to restart from.                          */
+	/*************************************************************************/
+	
+    char tmp[4096], buf[LOGBUFFER];
+    snapshotHeader hdr;
+    snapshotMarket sm;
+    market *m;
+    int fd, i, used = 0, err = 0;
+    
+    snprintf(tmp, sizeof (tmp), "%s.tmp", path);
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return (-1);
+    
+    memcpy(hdr.magic, SNAPMAGIC, 4);
+    hdr.version = ORDERVERSION;
+    hdr.recordSize = sizeof (order);
+    hdr.nsymbols = nsymbols;
+    hdr.position = position;
+    hdr.nextId = nextId;
+    err |= snapshotPut(fd, &hdr, sizeof (hdr), buf, &used);
+    
+    for (i = 0; i < nsymbols; i++)
+	{
+        m = markets[i];
+        sm.price = atomic_load(&m->currentPriceX10);
+        sm.orders = m->bm_q->size + m->sm_q->size + m->bl_q->size + m->sl_q->size + m->cancel_q->size
+                    + m->bs_q->size + m->ss_q->size + m->fired_q->size;
+        err |= snapshotPut(fd, &sm, sizeof (sm), buf, &used);
+        err |= snapshotQueue(fd, m->bm_q, buf, &used);
+        err |= snapshotQueue(fd, m->sm_q, buf, &used);
+        err |= snapshotBook(fd, m->bl_q, buf, &used);
+        err |= snapshotBook(fd, m->sl_q, buf, &used);
+        err |= snapshotQueue(fd, m->cancel_q, buf, &used);
+        err |= snapshotBook(fd, m->bs_q, buf, &used);
+        err |= snapshotBook(fd, m->ss_q, buf, &used);
+        err |= snapshotQueue(fd, m->fired_q, buf, &used);
+    }
+    if (used > 0 && write(fd, buf, used) != used)
+        err = -1;
+    if (fdatasync(fd) != 0)
+        err = -1;
+    close(fd);
+    
+    if (err != 0 || rename(tmp, path) != 0)
+	{
+        unlink(tmp);
+        return (-1);
+    }
+    return (0);
+}
+
+/*************** Write the orders of a queue to a snapshot, head first ***************/
+int snapshotQueue(int fd, queue *q, char *buf, int *used)
+{
+    order ord;
+    int n, err = 0;
+    
+    for (n = q->head; n != -1; n = poolLink(&q->pool, n)->next)
+	{
+        poolLoad(&q->pool, n, &ord);
+        err |= snapshotPut(fd, &ord, sizeof (ord), buf, used);
+    }
+    return (err);
+}
+
+/*************** Write the orders of a book side to a snapshot, level by level ***************/
+int snapshotBook(int fd, book *b, char *buf, int *used)
+{
+    order ord;
+    int i, n, err = 0;
+    
+    for (i = 0; i < b->nlevels; i++)
+	{
+        for (n = b->lvl[i].head; n != -1; n = poolLink(&b->pool, n)->next)
+		{
+            poolLoad(&b->pool, n, &ord);
+            if (b->triggers)
+                ord = stopKeyed(ord);
+            else if (ord.type == 'I')
+                ord.oldid = poolHot(&b->pool, n)->vol;	// the shares of the slice it shows
+            err |= snapshotPut(fd, &ord, sizeof (ord), buf, used);
+        }
+    }
+    return (err);
+}
+
+/*************** Buffered write to a snapshot ***************/
+int snapshotPut(int fd, const void *data, int len, char *buf, int *used)
+{
+    if (*used + len > LOGBUFFER)
+	{
+        if (write(fd, buf, *used) != *used)
+            return (-1);
+        *used = 0;
+    }
+    memcpy(buf + *used, data, len);
+    *used += len;
+    
+    return (0);
+}
+
+/******************** Snapshot loading function ********************/
+const snapshotHeader *snapshotOpen(const char *path)
+{
+	/*************************************************************************/
+	/* Maps the snapshot and checks that every market and order in it is     */
+	/* whole and in its place, so restoring it cannot go wrong halfway.      */
+	/*************************************************************************/
+	
+    const snapshotHeader *hdr;
+    const snapshotMarket *sm;
+    const order *rec;
+    const char *end;
+    struct stat st;
+    void *map;
+    int fd, i, j;
+    
+    fd = open(path, O_RDONLY);
+    if (fd < 0) return (NULL);
+    if (fstat(fd, &st) != 0 || st.st_size < 0 || (size_t) st.st_size < sizeof (snapshotHeader))
+	{
+        close(fd);
+        return (NULL);
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return (NULL);
+    
+    hdr = (const snapshotHeader *) map;
+    end = (const char *) map + st.st_size;
+    if (memcmp(hdr->magic, SNAPMAGIC, 4) != 0 || hdr->version != ORDERVERSION || hdr->recordSize != sizeof (order)
+        || hdr->nsymbols < 1 || hdr->nsymbols > MAXSYMBOLS)
+	{
+        munmap(map, st.st_size);
+        return (NULL);
+    }
+    
+    sm = (const snapshotMarket *) (hdr + 1);
+    for (i = 0; i < hdr->nsymbols; i++)
+	{
+        rec = (const order *) (sm + 1);
+        if ((const char *) rec > end || sm->orders < 0 || (size_t) sm->orders > (size_t) (end - (const char *) rec) / sizeof (order))
+            break;
+        for (j = 0; j < sm->orders; j++)
+            if (rec[j].symbol != i || queueOf(&rec[j]) == -1)
+                break;
+        if (j < sm->orders)
+            break;
+        sm = (const snapshotMarket *) (rec + sm->orders);
+    }
+    if (i < hdr->nsymbols || (const char *) sm != end)
+	{
+        munmap(map, st.st_size);
+        return (NULL);
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    
+    return (hdr);
+}
+
+/******************** Snapshot restoring function ********************/
+long snapshotRestore(const snapshotHeader *hdr)
+{
+	/*************************************************************************/
+	/* Routes the saved orders back in batches, as Cons would, in the order  */
+	/* they were saved in, so every queue and price level gets its FIFO      */
+	/* back. Nothing trades until the engine starts. Returns the number of   */
+	/* orders restored.                                                      */
+	/*************************************************************************/
+	
+    const snapshotMarket *sm = (const snapshotMarket *) (hdr + 1);
+    const order *rec;
+    order group[RINGBATCH];
+    long now = getNanos(), total = 0;
+    int i, j, k, x, dest;
+    
+    for (i = 0; i < hdr->nsymbols; i++)
+	{
+        rec = (const order *) (sm + 1);
+        atomic_store(&markets[i]->currentPriceX10, sm->price);
+        for (j = 0; j < sm->orders; j += k)
+		{
+			// the orders of one queue or book side were saved together
+            dest = queueOf(&rec[j]);
+            for (k = 0; k < RINGBATCH && j + k < sm->orders && queueOf(&rec[j + k]) == dest; k++)
+			{
+                group[k] = rec[j + k];
+                group[k].enqueued = group[k].dispatched = now;
+            }
+            routeGroup(markets[i], dest, group, k);
+            if (dest == DEST_BL || dest == DEST_SL)
+                for (x = 0; x < k; x++)
+                    if (group[x].type == 'I')
+                        bookShow(markets[i], &group[x]);
+        }
+        total += sm->orders;
+        sm = (const snapshotMarket *) (rec + sm->orders);
+    }
+    position = hdr->position;
+    nextId = hdr->nextId;
+    
+    return (total);
+}
+
+/******************** Profiled mutex initialization function ********************/
+pthread_mutex_t *mutexInit()
+{
+	// every engine mutex carries its counters, whether it is profiled or not
+    lockStats *s = (lockStats *) calloc (1, sizeof (lockStats));
+    
+    pthread_mutex_init(&s->mut, NULL);
+    return (&s->mut);
+}
+
+/******************** Take a lock function ********************/
+void lockTake(pthread_mutex_t *mut)
+{
+	/*************************************************************************/
+	/* pthread_mutex_lock, counted with -K. The counters other than the     */
+	/* trylock failures only change while the lock is held, so the holder   */
+	/* updates them with plain stores. An uncontended take does not read   */
+	/* the clock for its wait.                                             */
+	/*************************************************************************/
+	
+    lockStats *s = (lockStats *) mut;
+    long start, now;
+    
+    if (!profiling)
+	{
+        pthread_mutex_lock(mut);
+        return;
+    }
+    if (pthread_mutex_trylock(mut) == 0)
+        start = now = getNanos();
+    else
+	{
+        start = getNanos();
+        pthread_mutex_lock(mut);
+        now = getNanos();
+    }
+    statAdd(s->taken, 1);
+    statAdd(s->waited, now - start);
+    if ((unsigned long)(now - start) > atomic_load_explicit(&s->maxWait, memory_order_relaxed))
+        atomic_store_explicit(&s->maxWait, now - start, memory_order_relaxed);
+    s->since = now;
+}
+
+/******************** Try a lock function ********************/
+int lockTry(pthread_mutex_t *mut)
+{
+	// pthread_mutex_trylock, counted with -K; a failure is counted without the lock
+    lockStats *s = (lockStats *) mut;
+    
+    if (pthread_mutex_trylock(mut) != 0)
+	{
+        if (profiling)
+            atomic_fetch_add_explicit(&s->failed, 1, memory_order_relaxed);
+        return (EBUSY);
+    }
+    if (profiling)
+	{
+        statAdd(s->taken, 1);
+        s->since = getNanos();
+    }
+    return (0);
+}
+
+/******************** Give a lock back function ********************/
+void lockGive(pthread_mutex_t *mut)
+{
+    lockStats *s = (lockStats *) mut;
+    
+    if (profiling)
+        statAdd(s->held, getNanos() - s->since);
+    pthread_mutex_unlock(mut);
+}
+
+/******************** Sum a lock's counters function ********************/
+void lockSum(pthread_mutex_t *mut, unsigned long *v)
+{
+	// taken, failed, waited, longest wait, held
+    lockStats *s = (lockStats *) mut;
+    unsigned long w;
+    
+    v[0] += atomic_load_explicit(&s->taken, memory_order_relaxed);
+    v[1] += atomic_load_explicit(&s->failed, memory_order_relaxed);
+    v[2] += atomic_load_explicit(&s->waited, memory_order_relaxed);
+    w = atomic_load_explicit(&s->maxWait, memory_order_relaxed);
+    if (w > v[3])
+        v[3] = w;
+    v[4] += atomic_load_explicit(&s->held, memory_order_relaxed);
+}
+
+/******************** Loop counters initialization function ********************/
+void loopsInit(int role, int symbol)
+{
+	// with -K the calling thread counts its passes, on a lock-free list profileDump walks
+    loopStats *head;
+    
+    if (!profiling)
+        return;
+    myLoops = (loopStats *) calloc (1, sizeof (loopStats));
+    myLoops->role = role;
+    myLoops->symbol = symbol;
+    head = atomic_load(&loop_list);
+    do
+        myLoops->next = head;
+    while (!atomic_compare_exchange_weak(&loop_list, &head, myLoops));
+}
+
+/******************** Count a loop pass function ********************/
+void loopCount(int useful)
+{
+	// a useful pass moved orders, an idle one waited for them or for room
+    if (myLoops == NULL)
+        return;
+    if (useful)
+        statAdd(myLoops->useful, 1);
+    else
+        statAdd(myLoops->idle, 1);
+}
+
+/******************** Profiler function ********************/
+void* Profiler(void *arg)
+{
+	// dumps the profile every profileEvery ms, until profileClose
+    FILE *f = (FILE *) arg;
+    struct timespec t;
+    
+    clock_gettime(CLOCK_REALTIME, &t);
+    pthread_mutex_lock(&profileMut);
+    while (!profileDone)
+	{
+        t.tv_sec += profileEvery / 1000;
+        t.tv_nsec += (profileEvery % 1000) * 1000000;
+        if (t.tv_nsec >= 1000000000)
+		{
+            t.tv_sec++;
+            t.tv_nsec -= 1000000000;
+        }
+        while (!profileDone && pthread_cond_timedwait(&profileStop, &profileMut, &t) != ETIMEDOUT);
+        if (!profileDone)
+            profileDump(f);
+    }
+    pthread_mutex_unlock(&profileMut);
+    return (NULL);
+}
+
+/******************** Profile dump function ********************/
+void profileDump(FILE *f)
+{
+	/*************************************************************************/
+	/* Sums each kind of lock over the markets, then lists the passes of    */
+	/* every engine thread. The threads are not stopped, so a dump taken    */
+	/* while they run may be a few counts behind.                          */
+	/*************************************************************************/
+	
+    static const char *name[NLOCKS] = {"incoming", "bm_q", "sm_q", "bl_q", "sl_q", "cancel_q", "lock_transaction", "stops"};
+    unsigned long v[NLOCKS][5];
+    loopStats *t;
+    market *m;
+    int i;
+    
+    memset(v, 0, sizeof (v));
+    if (ingest == INGEST_QUEUE)
+        lockSum(((queue *) incoming)->mut, v[0]);
+    for (i = 0; i < nsymbols; i++)
+	{
+        m = markets[i];
+        lockSum(m->bm_q->mut, v[1]);
+        lockSum(m->sm_q->mut, v[2]);
+        lockSum(m->bl_q->mut, v[3]);
+        lockSum(m->sl_q->mut, v[4]);
+        lockSum(m->cancel_q->mut, v[5]);
+        lockSum(m->lock_transaction, v[6]);
+        lockSum(m->bs_q->mut, v[7]);
+        lockSum(m->ss_q->mut, v[7]);
+        lockSum(m->fired_q->mut, v[7]);
+    }
+    
+    fprintf(f, "# %.3f s\n", getNanos() / 1e9);
+    fprintf(f, "lock                   taken      failed    wait(us)   wait max(ns)    held(us)  held mean(ns)\n");
+    for (i = 0; i < NLOCKS; i++)
+        fprintf(f, "%-16s %11lu %11lu %11lu %14lu %11lu %14lu\n", name[i], v[i][0], v[i][1], v[i][2] / 1000,
+                v[i][3], v[i][4] / 1000, v[i][0] ? v[i][4] / v[i][0] : 0);
+    fprintf(f, "thread   symbol      useful        idle\n");
+    for (t = atomic_load(&loop_list); t != NULL; t = t->next)
+        fprintf(f, "%-8s %6d %11lu %11lu\n", roleName[t->role], t->symbol,
+                atomic_load_explicit(&t->useful, memory_order_relaxed), atomic_load_explicit(&t->idle, memory_order_relaxed));
+    fprintf(f, "\n");
+    fflush(f);
+}
+
+/******************** Profile close function ********************/
+void profileClose(FILE *f, pthread_t t)
+{
+	// stops the periodic dumps, and dumps once more with the engine stopped
+    pthread_mutex_lock(&profileMut);
+    profileDone = 1;
+    pthread_cond_signal(&profileStop);
+    pthread_mutex_unlock(&profileMut);
+    pthread_join(t, NULL);
+    profileDump(f);
+    fclose(f);
+}
+
+/******************** Histogram of this thread function ********************/
+stageHist *histLocal()
+{
+	/*************************************************************************/
+	/* Every thread that records gets its own histograms, so recording is    */
+	/* a couple of plain stores. They are pushed on a lock-free list the     */
+	/* first time the thread records, which histMerge walks.                 */
+	/*************************************************************************/
+	
+    static __thread stageHist *mine = NULL;
+    stageHist *head;
+    
+    if (mine != NULL)
+        return (mine);
+    
+    mine = (stageHist *) calloc (1, sizeof (stageHist));
+    head = atomic_load(&hist_list);
+    do
+        mine->next = head;
+    while (!atomic_compare_exchange_weak(&hist_list, &head, mine));
+    
+    return (mine);
+}
+
+/******************** Histogram bucket function ********************/
+int histIndex(unsigned long v)
+{
+	// values below 2^HISTSUB are exact, above that every power of two
+	// is split into 2^HISTSUB buckets
+    int k;
+    
+    if (v < (1UL << HISTSUB))
+        return ((int) v);
+    k = 63 - __builtin_clzl(v);
+    return (((k - HISTSUB + 1) << HISTSUB) + (int)((v >> (k - HISTSUB)) & ((1UL << HISTSUB) - 1)));
+}
+
+/******************** Histogram bucket value function ********************/
+long histValue(int i)
+{
+	// lowest value of bucket i
+    int b = i >> HISTSUB;
+    
+    if (b == 0)
+        return (i);
+    return ((long)((1UL << HISTSUB) + (i & ((1 << HISTSUB) - 1))) << (b - 1));
+}
+
+/******************** Histogram record function ********************/
+void histAdd(int stage, long v)
+{
+	// only the owning thread writes, so no read-modify-write is needed
+    histogram *h = &histLocal()->stage[stage];
+    int i;
+    
+    if (v < 0) v = 0;
+    i = histIndex(v);
+    atomic_store_explicit(&h->count[i], atomic_load_explicit(&h->count[i], memory_order_relaxed) + 1, memory_order_relaxed);
+    atomic_store_explicit(&h->total, atomic_load_explicit(&h->total, memory_order_relaxed) + 1, memory_order_relaxed);
+    atomic_store_explicit(&h->sum, atomic_load_explicit(&h->sum, memory_order_relaxed) + v, memory_order_relaxed);
+    if ((unsigned long) v > atomic_load_explicit(&h->max, memory_order_relaxed))
+        atomic_store_explicit(&h->max, v, memory_order_relaxed);
+}
+
+/******************** Histogram merge function ********************/
+void histMerge(int stage, histogram *out)
+{
+	/*************************************************************************/
+	/* Sums one stage over all threads into out. It can run at any time,     */
+	/* the recording threads are not stopped; a merge taken while they run   */
+	/* may be a few samples behind.                                          */
+	/*************************************************************************/
+	
+    stageHist *t;
+    histogram *h;
+    unsigned long v;
+    int i;
+    
+    memset(out, 0, sizeof (histogram));
+    for (t = atomic_load(&hist_list); t != NULL; t = t->next)
+	{
+        h = &t->stage[stage];
+        for (i = 0; i < HISTSIZE; i++)
+            out->count[i] += atomic_load_explicit(&h->count[i], memory_order_relaxed);
+        out->total += atomic_load_explicit(&h->total, memory_order_relaxed);
+        out->sum += atomic_load_explicit(&h->sum, memory_order_relaxed);
+        v = atomic_load_explicit(&h->max, memory_order_relaxed);
+        if (v > out->max)
+            out->max = v;
+    }
+}
+
+/******************** Histogram percentile function ********************/
+long histPercentile(histogram *h, double p)
+{
+    unsigned long rank, seen = 0;
+    int i;
+    
+    if (h->total == 0)
+        return (0);
+    rank = (unsigned long)(p / 100.0 * (h->total - 1)) + 1;
+    for (i = 0; i < HISTSIZE; i++)
+	{
+        seen += h->count[i];
+        if (seen >= rank)
+            break;
+    }
+	// the top bucket holds the maximum, which is known exactly
+    if (i >= histIndex(h->max))
+        return (h->max);
+    return (histValue(i));
+}
+
+/******************** Latency report function ********************/
+void latencyReport(FILE *f)
+{
+    static const char *name[NSTAGES] = {"queue", "route", "match", "total"};
+    histogram *h = (histogram *) malloc (sizeof (histogram));
+    int s;
+    
+    fprintf(f, "stage        count      mean       p50       p99     p99.9       max  (ns)\n");
+    for (s = 0; s < NSTAGES; s++)
+	{
+        histMerge(s, h);
+        fprintf(f, "%-6s %11lu %9lu %9ld %9ld %9ld %9lu\n", name[s], h->total,
+                h->total ? h->sum / h->total : 0, histPercentile(h, 50), histPercentile(h, 99),
+                histPercentile(h, 99.9), h->max);
+    }
+    free(h);
+}
+
+/******************** Fill latency function ********************/
+void stageFill(orderCold *c1, orderCold *c2, long picked)
+{
+	// a trade fires when the later of its two orders arrives
+    orderCold *o = (c1->enqueued > c2->enqueued) ? c1 : c2;
+    long now = getNanos();
+    
+    histAdd(STAGE_ROUTE, picked - o->dispatched);
+    histAdd(STAGE_MATCH, now - picked);
+    histAdd(STAGE_TOTAL, now - o->enqueued);
+}
+
+/******************** Benchmark report function ********************/
+void benchReport(const char *path, unsigned int seed, long elapsed)
+{
+	/*************************************************************************/
+	/* Writes the run as one JSON object: configuration, throughput and the  */
+	/* latency percentiles of every stage in nanoseconds.                    */
+	/*************************************************************************/
+	
+    static const char *name[NSTAGES] = {"queue", "route", "match", "total"};
+    histogram *h = (histogram *) malloc (sizeof (histogram));
+    long trades;
+    double secs = elapsed / 1.0e9;
+    FILE *f;
+    int s;
+    
+    f = fopen(path, "wt");
+    if (f == NULL)
+	{
+        perror(path);
+        free(h);
+        return;
+    }
+    histMerge(STAGE_TOTAL, h);
+    trades = h->total;
+    fprintf(f, "{\"engine\": \"%s\", \"ingest\": \"%s\", \"symbols\": %d, \"workers\": %d, \"seed\": %u,\n",
+            sequencer ? "sequencer" : "threads",
+            (ingest == INGEST_QUEUE) ? "mutex" : (ingest == INGEST_RING) ? "ring" : "spin",
+            nsymbols, workers, seed);
+    fprintf(f, " \"orders\": %ld, \"rejected\": %ld, \"trades\": %ld, \"elapsed_s\": %.6f,\n", bench, (long) rejected, trades, secs);
+    fprintf(f, " \"orders_per_sec\": %.0f, \"trades_per_sec\": %.0f,\n", bench / secs, trades / secs);
+    fprintf(f, " \"latency_ns\": {");
+    for (s = 0; s < NSTAGES; s++)
+	{
+        histMerge(s, h);
+        fprintf(f, "%s\n  \"%s\": {\"count\": %lu, \"p50\": %ld, \"p99\": %ld, \"p99.9\": %ld, \"max\": %lu}",
+                s ? "," : "", name[s], h->total, histPercentile(h, 50), histPercentile(h, 99),
+                histPercentile(h, 99.9), h->max);
+    }
+    fprintf(f, "}}\n");
+    fclose(f);
+    free(h);
+}
+
+/******************** Order generator ********************/
+order makeOrder(generator *g)
+{
+    int magnitude = 10;
+    order ord;
+    market *m;
+    
+    int waitmsec = rngUniform(&g->r) * magnitude;
+    if (bench == 0)
+        usleep(waitmsec*1000);
+    
+	// generator g makes the ids g, g+N, g+2N... for N generators
+    ord.id = g->index + (long) generators * g->count++;
+    ord.timestamp = getNanos();
+    ord.symbol = symbolOf(ord.id);
+    ord.aux = 0;
+    m = markets[ord.symbol];
+    
+    // Buy or Sell
+    ord.action = (rngUniform(&g->r) <= 0.5) ? 'B' : 'S';
+    
+    // Order type, stop and iceberg orders only with -t
+    double u2 = rngUniform(&g->r);
+    double upM = allTypes ? 0.35 : 0.4, upL = allTypes ? 0.75 : 0.9, upI = allTypes ? 0.8 : 0.9;
+    if (u2 < upM)
+	{
+        ord.type = 'M';                 // Market order
+        ord.vol = (1 + rngNext(&g->r)%50)*100;
+        
+    }
+	else if (upM <= u2 && u2 < upL)
+	{
+        ord.type = 'L';                 // Limit order
+        ord.vol = (1 + rngNext(&g->r)%50)*100;
+        
+        ord.price = atomic_load_explicit(&m->currentPriceX10, memory_order_relaxed) + 10*(0.5 - rngUniform(&g->r));
+    }
+	else if (upL <= u2 && u2 < upI)
+	{
+        ord.type = 'I';                 // Iceberg order, shows 100 to 500 shares at a time
+        ord.vol = (1 + rngNext(&g->r)%50)*100;
+        ord.aux = (1 + rngNext(&g->r)%5)*100;
+        
+        ord.price = atomic_load_explicit(&m->currentPriceX10, memory_order_relaxed) + 10*(0.5 - rngUniform(&g->r));
+    }
+	else if (upI <= u2 && u2 < 0.9)
+	{
+        ord.type = (u2 < upI + 0.05) ? 'S' : 'T';   // Stop market or stop limit order
+        ord.vol = (1 + rngNext(&g->r)%50)*100;
+        
+		// set off up to a share above (buys) or below (sells) the current price,
+		// a stop limit then buys or sells up to half a share past its stop price
+        ord.aux = atomic_load_explicit(&m->currentPriceX10, memory_order_relaxed) + ((ord.action == 'B') ? 1 : -1) * (int) (1 + rngNext(&g->r)%10);
+        ord.price = (ord.type == 'T') ? ord.aux + ((ord.action == 'B') ? 1 : -1) * (int) (rngNext(&g->r)%6) : 0;
+    }
+    else if (0.9 <= u2)
+	{
+        ord.type = 'C';                 // Cancel order
+        ord.oldid = g->index + (long) generators * (long)(rngUniform(&g->r) * g->count);	// one of its own
+        ord.symbol = symbolOf(ord.oldid);	// cancel goes to the book of the order
+    }
+    //dispOrder(ord);
+    return (ord);
+}
+
+/******************** Order generator initialization function ********************/
+generator *generatorInit(int index, unsigned int seed)
+{
+    generator *g;
+    
+    g = (generator *)aligned_alloc (CACHELINE, sizeof (generator));
+    if (g == NULL) return (NULL);
+    
+	// every generator has its own stream, the same for a given seed
+    rngSeed(&g->r, ((unsigned long) seed << 16) + index);
+    g->index = index;
+    g->count = 0;
+    g->limit = -1;
+    if (bench > 0)
+        g->limit = bench / generators + (index < bench % generators);
+    
+    return (g);
+}
+
+/******************** Random number generator seeding function ********************/
+void rngSeed(rng *r, unsigned long seed)
+{
+	// splitmix64 spreads any seed over the whole state
+    int i;
+    unsigned long z;
+    
+    for (i = 0; i < 4; i++)
+	{
+        z = (seed += 0x9E3779B97F4A7C15UL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9UL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBUL;
+        r->s[i] = z ^ (z >> 31);
+    }
+}
+
+/******************** Random number generator function ********************/
+unsigned long rngNext(rng *r)
+{
+	// xoshiro256**
+    unsigned long *s = r->s;
+    unsigned long result = rotl64(s[1] * 5, 7) * 9;
+    unsigned long t = s[1] << 17;
+    
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl64(s[3], 45);
+    
+    return (result);
+}
+
+/******************** Uniform [0,1) random number function ********************/
+double rngUniform(rng *r)
+{
+    return ((rngNext(r) >> 11) * (1.0 / 9007199254740992.0));
+}
+
+/******************** Symbol of an order id function ********************/
+int symbolOf(long id)
+{
+	// the generator spreads ids over the symbols with a multiplicative hash,
+	// so a cancel can find the symbol of the order it refers to
+    unsigned long h = (unsigned long)id * 0x9E3779B97F4A7C15UL;
+    
+    return ((h >> 32) % nsymbols);
+}
+
+/******************** Get time function ********************/
+long getTimestamp()
+{
+    return (getNanos() / 1000000);
+}
+
+/******************** Get time in nanoseconds function ********************/
+long getNanos()
+{
+    struct timespec now;
+    
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    
+    return ((now.tv_sec - startwtime.tv_sec) * 1000000000L + now.tv_nsec - startwtime.tv_nsec);
+}
+
+/******************** Display order function ********************/
+void dispOrder(order ord)
+{
+    printf("%08ld ", ord.id);
+    printf("%08ld ", ord.timestamp / 1000000);
+    switch( ord.type )
+	{
+        case 'M':
+            printf("%c ", ord.action);
+            printf("Market (%4d)        ", ord.vol); 
+			break;
+            
+        case 'L':
+            printf("%c ", ord.action);
+            printf("Limit  (%4d,%5.1f) ", ord.vol, (float) ord.price/10.0); 
+			break;
+            
+        case 'C':
+            printf("* Cancel  %6ld        ", ord.oldid); 
+			break;
+            
+        case 'I':
+            printf("%c ", ord.action);
+            printf("Iceberg(%4d,%5.1f) ", ord.vol, (float) ord.price/10.0); 
+			break;
+            
+        case 'S':
+            printf("%c ", ord.action);
+            printf("Stop   (%4d,%5.1f) ", ord.vol, (float) ord.aux/10.0); 
+			break;
+            
+        case 'T':
+            printf("%c ", ord.action);
+            printf("StopLim(%4d,%5.1f) ", ord.vol, (float) ord.aux/10.0); 
+			break;
+        default : break;
+    }
+    printf("\n");
+}
+
+/******************** Market initialization function ********************/
+market *marketInit (int symbol)
+{
+    market *m;
+    
+    m = (market *)malloc (sizeof (market));
+    if (m == NULL) return (NULL);
+    
+    m->symbol = symbol;
+    atomic_init(&m->currentPriceX10, 1000);
+    m->bm_q = queueInit(capacity);
+    m->sm_q = queueInit(capacity);
+    m->bl_q = bookInit(symbol, 'B', m->currentPriceX10);
+    m->sl_q = bookInit(symbol, 'S', m->currentPriceX10);
+    m->cancel_q = queueInit(capacity);
+    m->bs_q = bookInit(symbol, 'S', m->currentPriceX10);
+    m->ss_q = bookInit(symbol, 'B', m->currentPriceX10);
+    m->bs_q->triggers = m->ss_q->triggers = 1;
+    m->bs_q->capacity = m->ss_q->capacity = 0;
+    m->fired_q = queueInit(0);
+    m->index = indexInit(!sequencer);
+	// the orders of each queue and book side are kept on the node of the trier taking them
+    m->bm_q->pool.node = cpuNode(roleCore[ROLE_BM]);
+    m->sm_q->pool.node = cpuNode(roleCore[ROLE_SM]);
+    m->bl_q->pool.node = cpuNode(roleCore[ROLE_BL]);
+    m->sl_q->pool.node = cpuNode(roleCore[ROLE_SL]);
+    m->cancel_q->pool.node = cpuNode(roleCore[ROLE_CANCEL]);
+    m->lock_transaction = mutexInit();
+    m->auction = 0;
+    m->bar.start = -1;
+    m->volume = m->notional = 0;
+    
+    return (m);
+}
+
+/******************** Order pool initialization function ********************/
+void poolInit (orderPool *p)
+{
+	// no chunk is taken until the first order arrives
+    p->chunk = NULL;
+    p->nchunks = 0;
+    p->maxchunks = 0;
+    p->freeNode = -1;
+    p->node = -1;
+}
+
+/*************** Take a node from an order pool ( O(1) time )***************/
+int poolGet (orderPool *p)
+{
+	/*************************************************************************/
+	/* An empty free list adds one chunk of POOLCHUNK nodes. Chunks never    */
+	/* move once allocated, so a node number stays valid while the pool     */
+	/* grows; only the small chunk table is reallocated.                     */
+	/*************************************************************************/
+	
+    poolChunk *c;
+    int n, i;
+    
+    if (p->freeNode == -1)
+	{
+        if (p->nchunks == p->maxchunks)
+		{
+            p->maxchunks = p->maxchunks ? 2 * p->maxchunks : 4;
+            p->chunk = (poolChunk **) realloc (p->chunk, p->maxchunks * sizeof (poolChunk *));
+        }
+        c = chunkAlloc(p->node);
+        if (c == NULL)
+		{
+            perror("poolGet");
+            exit(1);
+        }
+        n = p->nchunks << POOLSHIFT;
+        for (i = 0; i < POOLCHUNK-1; i++)
+            c->link[i].next = n + i + 1;
+        c->link[POOLCHUNK-1].next = -1;
+        p->chunk[p->nchunks++] = c;
+        p->freeNode = n;
+    }
+    
+    n = p->freeNode;
+    p->freeNode = poolLink(p, n)->next;
+    
+    return (n);
+}
+
+/******************** Pool chunk allocation function ********************/
+poolChunk *chunkAlloc(int node)
+{
+	/*************************************************************************/
+	/* A chunk for a node is mapped on its own, so none of its pages has    */
+	/* been touched before mbind says where they go. MPOL_PREFERRED falls   */
+	/* back to another node when that one is out of memory, and a kernel    */
+	/* without NUMA leaves the chunk wherever it is touched first.          */
+	/*************************************************************************/
+	
+    unsigned long mask;
+    void *c;
+    
+    if (node < 0 || node >= 63)
+        return ((poolChunk *) aligned_alloc (CACHELINE, sizeof (poolChunk)));
+    c = mmap(NULL, sizeof (poolChunk), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (c == MAP_FAILED)
+        return (NULL);
+    mask = 1UL << node;
+    syscall(SYS_mbind, c, sizeof (poolChunk), MPOL_PREFERRED, &mask, 8 * sizeof (mask), 0);
+    return ((poolChunk *) c);
+}
+
+/*************** Return a node to an order pool ( O(1) time )***************/
+void poolPut (orderPool *p, int n)
+{
+    poolLink(p, n)->next = p->freeNode;
+    p->freeNode = n;
+}
+
+/*************** Store an order in node n of a pool ***************/
+void poolStore (orderPool *p, int n, const order *in)
+{
+    orderHot *h = poolHot(p, n);
+    orderCold *c = poolCold(p, n);
+    
+    h->price = in->price;
+    h->vol = in->vol;
+    c->aux = in->aux;
+    c->hidden = 0;
+	// an iceberg shows aux shares at a time, what is left over last
+    if (in->type == 'I' && in->aux > 0 && in->aux < in->vol)
+	{
+        h->vol = in->aux;
+        c->hidden = in->vol - in->aux;
+    }
+    h->id = (int) in->id;
+    h->symbol = in->symbol;
+    h->action = in->action;
+    h->type = in->type;
+    c->id = in->id;
+    c->oldid = in->oldid;
+    c->timestamp = in->timestamp;
+    c->enqueued = in->enqueued;
+    c->dispatched = in->dispatched;
+}
+
+/*************** Load the order in node n of a pool ***************/
+void poolLoad (orderPool *p, int n, order *out)
+{
+    orderHot *h = poolHot(p, n);
+    orderCold *c = poolCold(p, n);
+    
+    out->id = c->id;
+    out->oldid = c->oldid;
+    out->timestamp = c->timestamp;
+    out->enqueued = c->enqueued;
+    out->dispatched = c->dispatched;
+    out->vol = h->vol + c->hidden;
+    out->aux = c->aux;
+    out->price = h->price;
+    out->symbol = h->symbol;
+    out->action = h->action;
+    out->type = h->type;
+}
+
+/******************** Delete order pool function ********************/
+void poolDelete (orderPool *p)
+{
+    int i;
+    
+    for (i = 0; i < p->nchunks; i++)
+	{
+        if (p->node >= 0 && p->node < 63)
+            munmap(p->chunk[i], sizeof (poolChunk));
+        else
+            free(p->chunk[i]);
+    }
+    free(p->chunk);
+}
+
+/******************** Queue initilization function ********************/
+queue *queueInit (int capacity)
+{
+    queue *q;
+    
+    q = (queue *)malloc (sizeof (queue));
+    if (q == NULL) return (NULL);
+    
+    poolInit(&q->pool);
+    q->head = -1;
+    q->tail = -1;
+    q->size = 0;
+    q->capacity = capacity;
+    q->empty = 1;
+    q->full = 0;
+    q->mut = mutexInit();
+    q->notFull = (pthread_cond_t *) malloc (sizeof (pthread_cond_t));
+    pthread_cond_init (q->notFull, NULL);
+    q->notEmpty = (pthread_cond_t *) malloc (sizeof (pthread_cond_t));
+    pthread_cond_init (q->notEmpty, NULL);
+	
+    return (q);
+}
+
+/******************** Delete queue function ********************/
+void queueDelete (queue *q)
+{
+    poolDelete (&q->pool);
+    pthread_mutex_destroy (q->mut);
+    free (q->mut);
+    pthread_cond_destroy (q->notFull);
+    free (q->notFull);
+    pthread_cond_destroy (q->notEmpty);
+    free (q->notEmpty);
+    free (q);
+}
+
+/******************** Add order to queue function ********************/
+int queueAdd (queue *q, order in)
+{
+	// returns the node, which stays put until the order leaves the queue
+    orderLink *node;
+    int n;
+    
+    n = poolGet(&q->pool);
+    poolStore(&q->pool, n, &in);
+    node = poolLink(&q->pool, n);
+    node->next = -1;
+    node->prev = q->tail;
+    if (q->tail == -1)
+        q->head = n;
+    else
+        poolLink(&q->pool, q->tail)->next = n;
+    q->tail = n;
+    
+    q->size++;
+    if (q->size == q->capacity)
+        q->full = 1;
+    q->empty = 0;
+    
+    return (n);
+}
+
+/*************** Delete order from queue function***************/
+void queueDel (queue *q, order *out)
+{
+    poolLoad(&q->pool, q->head, out);
+    queueCancel(q, q->head);
+    
+    return;
+}
+
+/*************** Get the order at the head of a queue ( O(1) time )***************/
+orderHot *queueTop (queue *q)
+{
+    return (poolHot(&q->pool, q->head));
+}
+
+/*************** Get the cold fields of the order at the head of a queue ***************/
+orderCold *queueCold (queue *q)
+{
+    return (poolCold(&q->pool, q->head));
+}
+
+/******************** Multi-producer ring initialization function ********************/
+mpscRing *mpscInit (int park)
+{
+    mpscRing *r;
+    unsigned long i;
+    
+    r = (mpscRing *)aligned_alloc (CACHELINE, sizeof (mpscRing));
+    if (r == NULL) return (NULL);
+    
+	// slot i is free for the producer that claims position i
+    for (i = 0; i < RINGSIZE; i++)
+        atomic_init(&r->slot[i].seq, i);
+    atomic_init(&r->tail, 0);
+    atomic_init(&r->consWaiting, 0);
+    r->head = 0;
+    r->park = park;
+    r->mut = (pthread_mutex_t *) malloc (sizeof (pthread_mutex_t));
+    pthread_mutex_init (r->mut, NULL);
+    r->notEmpty = (pthread_cond_t *) malloc (sizeof (pthread_cond_t));
+    pthread_cond_init (r->notEmpty, NULL);
+    
+    return (r);
+}
+
+/*************** Publish n orders to the ring (any producer) ***************/
+void mpscPut(mpscRing *r, const order *ord, int n)
+{
+	/*************************************************************************/
+	/* Same scheme as the trade log: the producer claims n positions with    */
+	/* one fetch-and-add and publishes each slot by storing its next         */
+	/* sequence number. It waits only while the consumer is a whole ring     */
+	/* behind, spinning first and then yielding its core.                    */
+	/*************************************************************************/
+	
+    unsigned long pos;
+    ringSlot *s;
+    int i, spins;
+    
+    pos = atomic_fetch_add_explicit(&r->tail, n, memory_order_relaxed);
+    for (i = 0; i < n; i++)
+	{
+        s = &r->slot[(pos + i) & (RINGSIZE-1)];
+        for (spins = 0; atomic_load_explicit(&s->seq, memory_order_acquire) != pos + i; spins++)
+		{
+            if (!r->park || spins < SPINCOUNT)
+                cpuRelax();
+            else
+                sched_yield();
+        }
+        s->ord = ord[i];
+        atomic_store_explicit(&s->seq, pos + i + 1, memory_order_release);
+    }
+    
+    // wake the consumer if it parked on an empty ring
+    if (r->park)
+	{
+        atomic_thread_fence(memory_order_seq_cst);
+        if (atomic_load_explicit(&r->consWaiting, memory_order_relaxed))
+		{
+            pthread_mutex_lock(r->mut);
+            pthread_cond_signal(r->notEmpty);
+            pthread_mutex_unlock(r->mut);
+        }
+    }
+}
+
+/*************** Consume up to max published orders (consumer side) ***************/
+int mpscPop(mpscRing *r, order *out, int max)
+{
+	// stops at the first slot not published yet, so the orders come out in claim order
+    ringSlot *s;
+    int n;
+    
+    for (n = 0; n < max; n++)
+	{
+        s = &r->slot[r->head & (RINGSIZE-1)];
+        if (atomic_load_explicit(&s->seq, memory_order_acquire) != r->head + 1)
+            break;
+        out[n] = s->ord;
+        atomic_store_explicit(&s->seq, r->head + RINGSIZE, memory_order_release);
+        r->head++;
+    }
+    return (n);
+}
+
+/*************** Consume 1 to max orders, waiting while the ring is empty ***************/
+int mpscTake(mpscRing *r, order *out, int max)
+{
+    int n, spins = 0;
+    
+    while ((n = mpscPop(r, out, max)) == 0)
+	{
+        loopCount(0);
+        if (!r->park || ++spins < SPINCOUNT)
+		{
+            cpuRelax();
+            continue;
+        }
+        if (waitMode == WAIT_YIELD)
+		{
+            sched_yield();
+            continue;
+        }
+        
+        // park for idle periods: producers check consWaiting after every publish
+        pthread_mutex_lock(r->mut);
+        atomic_store(&r->consWaiting, 1);
+        while (atomic_load(&r->slot[r->head & (RINGSIZE-1)].seq) != r->head + 1)
+            pthread_cond_wait(r->notEmpty, r->mut);
+        atomic_store(&r->consWaiting, 0);
+        pthread_mutex_unlock(r->mut);
+        spins = 0;
+    }
+    return (n);
+}
+
+/*************** Publish up to n orders without waiting (sole producer) ***************/
+int mpscOffer(mpscRing *r, const order *ord, int n)
+{
+	// with no other producer the free slots from tail on stay free, so they can all be put
+    unsigned long tail;
+    int k;
+    
+    tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    for (k = 0; k < n; k++)
+        if (atomic_load_explicit(&r->slot[(tail + k) & (RINGSIZE-1)].seq, memory_order_acquire) != tail + k)
+            break;
+    if (k > 0)
+        mpscPut(r, ord, k);
+    return (k);
+}
+
+/******************** Incoming ring initialization function ********************/
+spscRing *spscInit (int park)
+{
+    spscRing *r;
+    
+    r = (spscRing *)aligned_alloc (CACHELINE, sizeof (spscRing));
+    if (r == NULL) return (NULL);
+    
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+    atomic_init(&r->consWaiting, 0);
+    atomic_init(&r->prodWaiting, 0);
+    r->headCache = 0;
+    r->tailCache = 0;
+    r->park = park;
+    r->mut = (pthread_mutex_t *) malloc (sizeof (pthread_mutex_t));
+    pthread_mutex_init (r->mut, NULL);
+    r->notFull = (pthread_cond_t *) malloc (sizeof (pthread_cond_t));
+    pthread_cond_init (r->notFull, NULL);
+    r->notEmpty = (pthread_cond_t *) malloc (sizeof (pthread_cond_t));
+    pthread_cond_init (r->notEmpty, NULL);
+    
+    return (r);
+}
+
+/*************** Publish up to n orders to the ring (producer side) ***************/
+int spscPush(spscRing *r, const order *ord, int n)
+{
+	/*************************************************************************/
+	/* The producer only reads the consumer's head again when its cached     */
+	/* copy says the ring is full, so the two cache lines bounce once per    */
+	/* batch instead of once per order. The release store of tail makes the */
+	/* written orders visible to the consumer's acquire load.                */
+	/*************************************************************************/
+	
+    unsigned long tail;
+    int i;
+    
+    tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    if (tail + n - r->headCache > RINGSIZE)
+        r->headCache = atomic_load_explicit(&r->head, memory_order_acquire);
+    if (tail + n - r->headCache > RINGSIZE)
+        n = RINGSIZE - (tail - r->headCache);
+    if (n == 0)
+        return (0);
+    
+    for (i = 0; i < n; i++)
+        r->item[(tail + i) & (RINGSIZE-1)] = ord[i];
+    atomic_store_explicit(&r->tail, tail + n, memory_order_release);
+    
+    // wake the consumer if it parked on an empty ring
+    if (r->park)
+	{
+        atomic_thread_fence(memory_order_seq_cst);
+        if (atomic_load_explicit(&r->consWaiting, memory_order_relaxed))
+		{
+            pthread_mutex_lock(r->mut);
+            pthread_cond_signal(r->notEmpty);
+            pthread_mutex_unlock(r->mut);
+        }
+    }
+    return (n);
+}
+
+/*************** Consume up to max orders from the ring (consumer side) ***************/
+int spscPop(spscRing *r, order *out, int max)
+{
+    unsigned long head;
+    int i, n;
+    
+    head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    if (head == r->tailCache)
+        r->tailCache = atomic_load_explicit(&r->tail, memory_order_acquire);
+    n = r->tailCache - head;
+    if (n > max)
+        n = max;
+    if (n == 0)
+        return (0);
+    
+    for (i = 0; i < n; i++)
+        out[i] = r->item[(head + i) & (RINGSIZE-1)];
+    atomic_store_explicit(&r->head, head + n, memory_order_release);
+    
+    // wake the producer if it parked on a full ring
+    if (r->park)
+	{
+        atomic_thread_fence(memory_order_seq_cst);
+        if (atomic_load_explicit(&r->prodWaiting, memory_order_relaxed))
+		{
+            pthread_mutex_lock(r->mut);
+            pthread_cond_signal(r->notFull);
+            pthread_mutex_unlock(r->mut);
+        }
+    }
+    return (n);
+}
+
+/*************** Publish n orders, waiting while the ring is full ***************/
+void spscPut(spscRing *r, const order *ord, int n)
+{
+    int done, spins = 0;
+    
+    for (done = 0; done < n; )
+	{
+        if ((done += spscPush(r, ord + done, n - done)) == n)
+            break;
+        if (!r->park || ++spins < SPINCOUNT)
+		{
+            cpuRelax();
+            continue;
+        }
+        
+        // park: the consumer checks prodWaiting after every consume
+        pthread_mutex_lock(r->mut);
+        atomic_store(&r->prodWaiting, 1);
+        while (atomic_load(&r->tail) - atomic_load(&r->head) == RINGSIZE)
+		{
+            printf ("*** Incoming Order Ring is FULL.\n"); fflush(stdout);
+            pthread_cond_wait(r->notFull, r->mut);
+        }
+        atomic_store(&r->prodWaiting, 0);
+        pthread_mutex_unlock(r->mut);
+        spins = 0;
+    }
+}
+
+/*************** Consume 1 to max orders, waiting while the ring is empty ***************/
+int spscTake(spscRing *r, order *out, int max)
+{
+    int n, spins = 0;
+    
+    while ((n = spscPop(r, out, max)) == 0)
+	{
+        if (!r->park || ++spins < SPINCOUNT)
+		{
+            cpuRelax();
+            continue;
+        }
+        
+        // park for idle periods: the producer checks consWaiting after every publish
+        pthread_mutex_lock(r->mut);
+        atomic_store(&r->consWaiting, 1);
+        while (atomic_load(&r->tail) == atomic_load(&r->head))
+            pthread_cond_wait(r->notEmpty, r->mut);
+        atomic_store(&r->consWaiting, 0);
+        pthread_mutex_unlock(r->mut);
+        spins = 0;
+    }
+    return (n);
+}
+
+/*************** Unlink node n from a queue ( O(1) time )***************/
+void queueCancel(queue *q, int n)
+{
+    orderLink *node = poolLink(&q->pool, n);
+    
+    if (node->prev == -1)
+        q->head = node->next;
+    else
+        poolLink(&q->pool, node->prev)->next = node->next;
+    if (node->next == -1)
+        q->tail = node->prev;
+    else
+        poolLink(&q->pool, node->next)->prev = node->prev;
+    poolPut(&q->pool, n);
+    
+    q->size--;
+    if (q->size == 0)
         q->empty = 1;
     q->full = 0;
-}
\ No newline at end of file
+}
+
+/******************** Book side initialization function ********************/
+book *bookInit (int symbol, char side, int price)
+{
+    book *b;
+    int i;
+    
+    b = (book *)malloc (sizeof (book));
+    if (b == NULL) return (NULL);
+    
+    // price window centered around the current price
+    b->symbol = symbol;
+    b->side = side;
+    b->nlevels = BOOKLEVELS;
+    b->base = price - BOOKLEVELS/2;
+    b->lvl = (level *)malloc (b->nlevels * sizeof (level));
+    for (i = 0; i < b->nlevels; i++)
+	{
+        b->lvl[i].head = b->lvl[i].tail = -1;
+        b->lvl[i].vol = b->lvl[i].orders = 0;
+    }
+    
+    poolInit(&b->pool);
+    b->sinceSnapshot = 0;
+    b->triggers = 0;
+    b->best = 0;
+    b->size = 0;
+    b->capacity = capacity;
+    b->empty = 1;
+    b->full = 0;
+    b->mut = mutexInit();
+    b->notFull = (pthread_cond_t *) malloc (sizeof (pthread_cond_t));
+    pthread_cond_init (b->notFull, NULL);
+    b->notEmpty = (pthread_cond_t *) malloc (sizeof (pthread_cond_t));
+    pthread_cond_init (b->notEmpty, NULL);
+    
+    return (b);
+}
+
+/*************** Get the price level of a book side ( O(1) time )***************/
+level *bookLevel(book *b, int price)
+{
+    if (price < b->base || price >= b->base + b->nlevels)
+        bookWiden(b, price);
+    
+    return (&b->lvl[price - b->base]);
+}
+
+/*************** Widen the price window of a book side to cover price ***************/
+void bookWiden(book *b, int price)
+{
+	/*************************************************************************/
+	/* The window at least doubles towards the side of the new price, so     */
+	/* re-indexing stays rare while the price drifts, up to MAXLEVELS. A     */
+	/* price it cannot reach even then stops the simulation; the gateway     */
+	/* keeps its clients' prices well inside it.                             */
+	/*************************************************************************/
+	
+    long lo, hi;
+    level *lvl;
+    int i;
+    
+    lo = b->base;
+    hi = b->base + b->nlevels;
+    while (price < lo)
+        lo -= hi - lo;
+    while (price >= hi)
+        hi += hi - lo;
+    if (hi - lo > MAXLEVELS)
+	{
+        if (price < b->base)
+            lo = hi - MAXLEVELS;
+        else
+            hi = lo + MAXLEVELS;
+    }
+    if (price < lo || price >= hi)
+	{
+        printf ("*** Price %5.1f is out of the range of the book.\n", (float) price/10.0); fflush(stdout);
+        exit(1);
+    }
+    
+    lvl = (level *)malloc ((hi - lo) * sizeof (level));
+    if (lvl == NULL)
+	{
+        perror("bookWiden");
+        exit(1);
+    }
+    for (i = 0; i < hi - lo; i++)
+	{
+        lvl[i].head = lvl[i].tail = -1;
+        lvl[i].vol = lvl[i].orders = 0;
+    }
+    memcpy(&lvl[b->base - lo], b->lvl, b->nlevels * sizeof (level));
+    
+    free(b->lvl);
+    b->lvl = lvl;
+    b->base = lo;
+    b->nlevels = hi - lo;
+}
+
+/*************** Insert order to a book side ***************/
+int bookInsert(book *b, order ord)
+{
+    return ((b->side == 'B') ? bookInsertSide(b, ord, 'B') : bookInsertSide(b, ord, 'S'));
+}
+
+/*************** Insert order to a book side of a known side ( O(1) time at an existing level )***************/
+SPECIALIZED int bookInsertSide(book *b, order ord, const char side)
+{
+	/*************************************************************************/
+	/* Take a node from the pool and append it to the FIFO of its            */
+	/* price level, so orders at equal prices keep their arrival order.      */
+	/* Then move the best-price cursor if the new order improves it.         */
+	/* Returns the node, which stays put until the order leaves the book.    */
+	/*************************************************************************/
+	
+    orderLink *node;
+    int n;
+    level *l;
+    
+    n = poolGet(&b->pool);
+    poolStore(&b->pool, n, &ord);
+    node = poolLink(&b->pool, n);
+    node->next = -1;
+    
+    l = bookLevel(b, ord.price);
+    node->prev = l->tail;
+    if (l->tail == -1)
+        l->head = n;
+    else
+        poolLink(&b->pool, l->tail)->next = n;
+    l->tail = n;
+    l->vol += poolHot(&b->pool, n)->vol;
+    l->orders++;
+    if (feed != NULL)
+        feedLevel(b, ord.price, l, (l->orders == 1) ? FEED_ADD : FEED_CHANGE);
+    
+    if (b->empty || BETTER(side, ord.price, b->best))
+        b->best = ord.price;
+    
+    b->size++;
+    if (b->size == b->capacity)
+        b->full = 1;
+    b->empty = 0;
+    
+    return (n);
+}
+
+/*************** Get the order at the top of a book side ( O(1) time )***************/
+orderHot *bookTop(book *b)
+{
+    return (poolHot(&b->pool, b->lvl[b->best - b->base].head));
+}
+
+/*************** Get the cold fields of the order at the top of a book side ***************/
+orderCold *bookCold(book *b)
+{
+    return (poolCold(&b->pool, b->lvl[b->best - b->base].head));
+}
+
+/*************** Delete the top order from a book side ***************/
+void bookDel(book *b, order *out)
+{
+    if (b->side == 'B')
+        bookDelSide(b, out, 'B');
+    else
+        bookDelSide(b, out, 'S');
+}
+
+/*************** Delete the top order from a book side of a known side ***************/
+SPECIALIZED void bookDelSide(book *b, order *out, const char side)
+{
+    level *l;
+    
+    l = &b->lvl[b->best - b->base];
+    poolLoad(&b->pool, l->head, out);
+    bookUnlinkSide(b, l->head, side);
+}
+
+/*************** Unlink node n from its price level ***************/
+void bookUnlink(book *b, int n)
+{
+    if (b->side == 'B')
+        bookUnlinkSide(b, n, 'B');
+    else
+        bookUnlinkSide(b, n, 'S');
+}
+
+/*************** Unlink node n from its price level of a known side ( O(1) time )***************/
+SPECIALIZED void bookUnlinkSide(book *b, int n, const char side)
+{
+    orderLink *node = poolLink(&b->pool, n);
+    orderHot *ord = poolHot(&b->pool, n);
+    level *l;
+    
+    l = &b->lvl[ord->price - b->base];
+    if (node->prev == -1)
+        l->head = node->next;
+    else
+        poolLink(&b->pool, node->prev)->next = node->next;
+    if (node->next == -1)
+        l->tail = node->prev;
+    else
+        poolLink(&b->pool, node->next)->prev = node->prev;
+    l->vol -= ord->vol;
+    l->orders--;
+    if (feed != NULL)
+        feedLevel(b, ord->price, l, (l->orders == 0) ? FEED_DELETE : FEED_CHANGE);
+    poolPut(&b->pool, n);
+    
+    b->size--;
+    if (b->size == 0)
+        b->empty = 1;
+    b->full = 0;
+    
+    // an emptied best level moves the cursor to the next non-empty level
+    if (!b->empty && l == &b->lvl[b->best - b->base] && l->head == -1)
+        do
+            b->best += WORSE(side);
+        while (b->lvl[b->best - b->base].head == -1);
+}
+
+/*************** Refill the top order of a book side from its hidden shares ***************/
+void bookRefill(book *b)
+{
+	/*************************************************************************/
+	/* The slice an iceberg showed is filled: its next slice is shown from   */
+	/* the same node, which keeps its index entry, and goes to the back of   */
+	/* its price level like a new order would.                               */
+	/*************************************************************************/
+	
+    level *l = &b->lvl[b->best - b->base];
+    int n = l->head;
+    orderHot *h = poolHot(&b->pool, n);
+    orderCold *c = poolCold(&b->pool, n);
+    orderLink *node = poolLink(&b->pool, n);
+    int shown;
+    
+    shown = (c->hidden < c->aux) ? c->hidden : c->aux;
+    c->hidden -= shown;
+    l->vol += shown - h->vol;
+    h->vol = shown;
+    if (l->tail != n)
+	{
+        l->head = node->next;
+        poolLink(&b->pool, node->next)->prev = -1;
+        node->next = -1;
+        node->prev = l->tail;
+        poolLink(&b->pool, l->tail)->next = n;
+        l->tail = n;
+    }
+    if (feed != NULL)
+        feedLevel(b, b->best, l, FEED_CHANGE);
+}
+
+/*************** Show the slice a restored iceberg showed ***************/
+void bookShow(market *m, const order *ord)
+{
+	/*************************************************************************/
+	/* A snapshot saves the whole volume of an iceberg and, in oldid, the    */
+	/* shares left of the slice it shows. The order went in showing a full   */
+	/* slice; it shows what it did, the rest going back to its hidden ones.  */
+	/*************************************************************************/
+	
+    indexEntry e;
+    orderHot *h;
+    orderCold *c;
+    level *l;
+    
+	// an order turned away by a full book side is not there
+    if (!indexFind(m->index, ord->id, &e) || e.b == NULL)
+        return;
+    h = poolHot(&e.b->pool, e.slot);
+    c = poolCold(&e.b->pool, e.slot);
+    if (ord->oldid <= 0 || ord->oldid > h->vol + c->hidden)
+        return;
+    l = bookLevel(e.b, h->price);
+    l->vol += ord->oldid - h->vol;
+    c->hidden += h->vol - ord->oldid;
+    h->vol = ord->oldid;
+    if (feed != NULL)
+        feedLevel(e.b, h->price, l, FEED_CHANGE);
+}
+
+/*************** Try a cancel thread ***************/
+void *CancelTry(void *arg)
+{
+    market *m = (market *) arg;
+    order ord;
+    long id;
+    int found, spins;
+    
+    loopsInit(ROLE_CANCEL, m->symbol);
+    while(1) 
+	{
+        lockTake(m->cancel_q->mut);
+        for (spins = 0; m->cancel_q->empty && running; spins++)
+		{
+            //  printf("*** Cancel Order Queue is Empty.\n");
+            waitOn(m->cancel_q->notEmpty, m->cancel_q->mut, spins, 0);
+        }
+        // once stopped, leave when all pending cancels are done
+        if (m->cancel_q->empty)
+		{
+            lockGive(m->cancel_q->mut);
+            break;
+        }
+        queueDel(m->cancel_q, &ord);
+        loopCount(1);
+        
+        id = ord.oldid;
+        
+        // Look the id up and unlink the order where it rests, the cancel
+        // queue still held, so a snapshot never falls between the two
+        found = orderCancel(m, id);
+        lockGive(m->cancel_q->mut);
+        pthread_cond_signal (m->cancel_q->notFull);
+        if (gate != NULL)
+            gatewayCancel(&ord, found);
+        if( found )
+		{
+            if (verbose) { printf("Canceled\n"); fflush(stdout); }
+		}	
+		else
+        {    
+			if (verbose) { printf("Not Found\n"); fflush(stdout); }
+		}
+    }
+    return (NULL);
+}
+
+/******************** Cancel order by id function ( O(1) time ) ********************/
+int orderCancel(market *m, long id)
+{
+	/*************************************************************************/
+	/* An order only leaves its queue or book side while that container is   */
+	/* locked, but it may move on under the same id: a stop that goes off    */
+	/* moves to the fired queue and from there to the queue or book side it  */
+	/* is routed to, its index entry with it. So once the lock is held the   */
+	/* id is looked up again, and the order is only unlinked if it is still  */
+	/* where it was; if it has moved, the cancel follows it there.           */
+	/*************************************************************************/
+	
+    indexEntry loc, now;
+    pthread_mutex_t *mut;
+    pthread_cond_t *notFull;
+    int found;
+    
+    while (indexFind(m->index, id, &loc))
+	{
+        mut = (loc.q != NULL) ? loc.q->mut : loc.b->mut;
+        notFull = (loc.q != NULL) ? loc.q->notFull : loc.b->notFull;
+        
+        lockTake(mut);
+        found = indexFind(m->index, id, &now) && now.q == loc.q && now.b == loc.b && now.slot == loc.slot;
+        if (found)
+		{
+            indexDel(m->index, id);
+            orderUnlink(&loc);
+        }
+        lockGive(mut);
+        if (found)
+		{
+            pthread_cond_signal(notFull);
+            return (1);
+        }
+    }
+    
+    return (0);
+}
+
+/******************** Unlink a resting order from its location ********************/
+void orderUnlink(indexEntry *loc)
+{
+    if (loc->q != NULL)
+        queueCancel(loc->q, loc->slot);
+    else
+        bookUnlink(loc->b, loc->slot);
+}
+
+/******************** Stop order as kept in the trigger table ********************/
+order stopKeyed(order ord)
+{
+	// the table is a book side keyed by the stop price, so it swaps with the limit; both ways
+    int price = ord.price;
+    
+    ord.price = ord.aux;
+    ord.aux = price;
+    return (ord);
+}
+
+/******************** Add a stop order function ( O(1) time at an existing level ) ********************/
+void stopAdd(market *m, order ord)
+{
+	/*************************************************************************/
+	/* A buy stop is set off by a trade at or above its stop price, a sell   */
+	/* stop by one at or below it, so each side of the table has its next  */
+	/* stop at the top. One the last trade has already reached goes off at  */
+	/* once. The caller holds the stop locks, unless it is the sequencer.   */
+	/*************************************************************************/
+	
+    int price = atomic_load_explicit(&m->currentPriceX10, memory_order_relaxed);
+    book *b = (ord.action == 'B') ? m->bs_q : m->ss_q;
+    
+    if ((ord.action == 'B') ? ord.aux <= price : ord.aux >= price)
+        indexAdd(m->index, ord.id, m->fired_q, NULL, stopFire(m, ord));
+    else
+        indexAdd(m->index, ord.id, NULL, b, bookInsert(b, stopKeyed(ord)));
+}
+
+/******************** Set a stop order off function ********************/
+int stopFire(market *m, order ord)
+{
+	// it becomes the market or limit order it stood for, arriving now; returns its node in the fired queue
+    ord.type = (ord.type == 'S') ? 'M' : 'L';
+    ord.aux = 0;
+    ord.enqueued = ord.dispatched = getNanos();
+    return (queueAdd(m->fired_q, ord));
+}
+
+/******************** Set the stops off function ( O(k) time for k stops ) ********************/
+void stopsFire(market *m, int hi, int lo)
+{
+	// for trades between lo and hi; only the stops that go off are looked at,
+	// and each stays in the index, so a cancel finds it in the fired queue
+    order ord;
+    
+    while (!m->bs_q->empty && m->bs_q->best <= hi)
+	{
+        bookDel(m->bs_q, &ord);
+        indexMove(m->index, ord.id, m->fired_q, NULL, stopFire(m, stopKeyed(ord)));
+    }
+    while (!m->ss_q->empty && m->ss_q->best >= lo)
+	{
+        bookDel(m->ss_q, &ord);
+        indexMove(m->index, ord.id, m->fired_q, NULL, stopFire(m, stopKeyed(ord)));
+    }
+}
+
+/******************** Lock the stops function ********************/
+void stopsLock(market *m)
+{
+	// taken after any other lock of the market, and never held while taking one
+    lockTake(m->bs_q->mut);
+    lockTake(m->ss_q->mut);
+    lockTake(m->fired_q->mut);
+}
+
+/******************** Unlock the stops function ********************/
+void stopsUnlock(market *m)
+{
+    lockGive(m->fired_q->mut);
+    lockGive(m->ss_q->mut);
+    lockGive(m->bs_q->mut);
+}
+
+/******************** Route stops set off function ********************/
+int stopsRoute(market *m)
+{
+	/*************************************************************************/
+	/* Sweeps set stops off while they hold the market locks, so they cannot */
+	/* route them; the thread that traded routes them once it has let its   */
+	/* locks go, in batches. Each order goes from the fired queue straight   */
+	/* to its queue or book side with both locked, so it is never out of     */
+	/* the index for a cancel, nor out of the queues for a snapshot. Returns */
+	/* the number routed.                                                    */
+	/*************************************************************************/
+	
+    order ord;
+    int n, woken = 0, total = 0;
+    
+    if (!sequencer)
+	{
+		// most trades set nothing off, and then the other locks are not needed
+        lockTake(m->fired_q->mut);
+        n = m->fired_q->empty;
+        lockGive(m->fired_q->mut);
+        if (n)
+            return (0);
+    }
+    do
+	{
+        if (!sequencer)
+		{
+			// in the order marketsLock takes them
+            lockTake(m->bm_q->mut);
+            lockTake(m->sm_q->mut);
+            lockTake(m->bl_q->mut);
+            lockTake(m->sl_q->mut);
+            lockTake(m->fired_q->mut);
+        }
+        for (n = 0; n < RINGBATCH && !m->fired_q->empty; n++)
+		{
+            queueDel(m->fired_q, &ord);
+            if (sequencer)
+			{
+                indexDel(m->index, ord.id);
+                seqPlace(m, ord);
+            }
+            else
+                woken |= 1 << routeFired(m, &ord);
+        }
+        if (!sequencer)
+		{
+            lockGive(m->fired_q->mut);
+            lockGive(m->sl_q->mut);
+            lockGive(m->bl_q->mut);
+            lockGive(m->sm_q->mut);
+            lockGive(m->bm_q->mut);
+        }
+        total += n;
+    } while (n == RINGBATCH);
+    
+    if (woken & (1 << DEST_BM)) pthread_cond_signal(m->bm_q->notEmpty);
+    if (woken & (1 << DEST_SM)) pthread_cond_signal(m->sm_q->notEmpty);
+    if (woken & (1 << DEST_BL)) pthread_cond_signal(m->bl_q->notEmpty);
+    if (woken & (1 << DEST_SL)) pthread_cond_signal(m->sl_q->notEmpty);
+    
+    return (total);
+}
+
+/******************** Route stop orders function ********************/
+void routeStops(market *m, order *group, int k)
+{
+    int i;
+    
+    if (!sequencer)
+        stopsLock(m);
+    for (i = 0; i < k; i++)
+        stopAdd(m, group[i]);
+    if (!sequencer)
+        stopsUnlock(m);
+	// some may have gone off at once
+    stopsRoute(m);
+}
+
+/******************** Route a stop set off function ********************/
+int routeFired(market *m, const order *ord)
+{
+	// under the locks of stopsRoute, past the capacity: the thread routing it
+	// may be the one that drains the queue. Returns where it went
+    int dest = queueOf(ord);
+    
+    switch (dest)
+	{
+        case DEST_BM: indexMove(m->index, ord->id, m->bm_q, NULL, queueAdd(m->bm_q, *ord)); break;
+        case DEST_SM: indexMove(m->index, ord->id, m->sm_q, NULL, queueAdd(m->sm_q, *ord)); break;
+        case DEST_BL: indexMove(m->index, ord->id, NULL, m->bl_q, bookInsert(m->bl_q, *ord)); break;
+        case DEST_SL: indexMove(m->index, ord->id, NULL, m->sl_q, bookInsert(m->sl_q, *ord)); break;
+        default : break;
+    }
+    return (dest);
+}
+
+/******************** Order index initialization function ********************/
+orderIndex *indexInit (int locked)
+{
+    orderIndex *x;
+    int i;
+    
+    x = (orderIndex *)malloc (sizeof (orderIndex));
+    if (x == NULL) return (NULL);
+    
+    x->item = (indexEntry *)malloc (INDEXSIZE * sizeof (indexEntry));
+    for (i = 0; i < INDEXSIZE; i++)
+        x->item[i].id = -1;
+    x->mask = INDEXSIZE-1;
+    x->size = 0;
+    x->mut = NULL;
+    if (locked)
+	{
+        x->mut = (pthread_mutex_t *) malloc (sizeof (pthread_mutex_t));
+        pthread_mutex_init (x->mut, NULL);
+    }
+    
+    return (x);
+}
+
+/******************** Home slot of an id in the order index ********************/
+int indexHome(orderIndex *x, long id)
+{
+    unsigned long h = (unsigned long)id * 0x9E3779B97F4A7C15UL;
+    
+    return ((h ^ (h >> 32)) & x->mask);
+}
+
+/******************** Grow the order index function ********************/
+void indexGrow(orderIndex *x)
+{
+	// doubles the table and reinserts every entry, the caller holds the lock
+    indexEntry *old = x->item;
+    int n = x->mask + 1, i, j;
+    
+    x->item = (indexEntry *)malloc (2 * n * sizeof (indexEntry));
+    x->mask = 2 * n - 1;
+    for (i = 0; i < 2 * n; i++)
+        x->item[i].id = -1;
+    for (i = 0; i < n; i++)
+	{
+        if (old[i].id == -1)
+            continue;
+        for (j = indexHome(x, old[i].id); x->item[j].id != -1; j = (j+1) & x->mask);
+        x->item[j] = old[i];
+    }
+    free(old);
+}
+
+/******************** Add id to the order index function ********************/
+void indexAdd(orderIndex *x, long id, queue *q, book *b, int slot)
+{
+    int i;
+    
+    if (x->mut) pthread_mutex_lock(x->mut);
+	// kept at most half full, so probe sequences stay short
+    if (2 * (x->size + 1) > x->mask + 1)
+        indexGrow(x);
+    for (i = indexHome(x, id); x->item[i].id != -1; i = (i+1) & x->mask);
+    x->item[i].id = id;
+    x->item[i].q = q;
+    x->item[i].b = b;
+    x->item[i].slot = slot;
+    x->size++;
+    if (x->mut) pthread_mutex_unlock(x->mut);
+}
+
+/******************** Find id in the order index function ********************/
+int indexFind(orderIndex *x, long id, indexEntry *out)
+{
+    int i, found = 0;
+    
+    if (x->mut) pthread_mutex_lock(x->mut);
+    for (i = indexHome(x, id); x->item[i].id != -1; i = (i+1) & x->mask)
+	{
+        if (x->item[i].id == id)
+		{
+            *out = x->item[i];
+            found = 1;
+            break;
+        }
+    }
+    if (x->mut) pthread_mutex_unlock(x->mut);
+    
+    return (found);
+}
+
+/******************** Move id in the order index function ********************/
+int indexMove(orderIndex *x, long id, queue *q, book *b, int slot)
+{
+	// in place, so a lookup never misses an order that changes containers
+    int i, found = 0;
+    
+    if (x->mut) pthread_mutex_lock(x->mut);
+    for (i = indexHome(x, id); x->item[i].id != -1; i = (i+1) & x->mask)
+	{
+        if (x->item[i].id == id)
+		{
+            x->item[i].q = q;
+            x->item[i].b = b;
+            x->item[i].slot = slot;
+            found = 1;
+            break;
+        }
+    }
+    if (x->mut) pthread_mutex_unlock(x->mut);
+    
+    return (found);
+}
+
+/******************** Delete id from the order index function ********************/
+int indexDel(orderIndex *x, long id)
+{
+	/*************************************************************************/
+	/* Linear probing with backward-shift deletion: entries after the hole   */
+	/* move back into it unless that would put them before their home slot, */
+	/* so lookups never need tombstones.                                     */
+	/*************************************************************************/
+	
+    int i, j, k;
+    
+    if (x->mut) pthread_mutex_lock(x->mut);
+    for (i = indexHome(x, id); x->item[i].id != id; i = (i+1) & x->mask)
+	{
+        if (x->item[i].id == -1)
+		{
+            if (x->mut) pthread_mutex_unlock(x->mut);
+            return (0);
+        }
+    }
+    
+    for (j = (i+1) & x->mask; x->item[j].id != -1; j = (j+1) & x->mask)
+	{
+        k = indexHome(x, x->item[j].id);
+        if ((i <= j) ? (i < k && k <= j) : (i < k || k <= j))
+            continue;
+        x->item[i] = x->item[j];
+        i = j;
+    }
+    x->item[i].id = -1;
+    x->size--;
+    if (x->mut) pthread_mutex_unlock(x->mut);
+    
+    return (1);
+}
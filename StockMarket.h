@@ -1,6 +1,99 @@
 #include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
 
-#define QUEUESIZE 5000
+#define QUEUESIZE 5000	// capacity of the incoming order queue
+#define POOLSHIFT 10
+#define POOLCHUNK (1 << POOLSHIFT)	// order nodes a pool grows by
+#define BOOKLEVELS 256	// initial number of price levels per book side
+#define MAXLEVELS (1 << 22)	// price levels the window of a book side may span at most
+#define MAXSYMBOLS 65536	// symbols an order can address
+#define INDEXSIZE 65536	// initial slots of the order id index (power of two)
+#define RINGSIZE 4096	// slots of the incoming order ring (power of two)
+#define RINGBATCH 64	// orders consumed from the ring at once
+#define SWEEPBATCH 64	// fills of a sweep reported at once
+#define SPINCOUNT 1000	// polls of an idle ring before parking
+#define IDLEWAIT 100	// us a trier with nothing to trade with blocks for at most
+#define CACHELINE 64
+#define LOGSIZE 65536	// slots of the trade log ring (power of two)
+#define LOGBUFFER 65536	// bytes written to the trade log at once
+#define TRADEMAGIC "SMTR"
+#define ORDERMAGIC "SMOF"
+#define FEEDMAGIC "SMFD"
+#define SNAPMAGIC "SMSS"
+#define JOURNALSIZE 65536	// orders the journal holds between acceptance and hand-on (power of two)
+#define SNAPFILE "snapshot.bin"	// written by -S, replaced whole by each snapshot
+#define GWCONNS 4096	// connections the gateway serves at once
+#define GWBUFFER 65536	// bytes buffered per gateway connection each way
+#define GWEVENTS 256	// epoll events the gateway handles per wait
+#define GWMAXMSG 1024	// longest gateway message accepted
+#define GWBAND 50	// percent of the last price a client's limit or stop price may be away from it
+#define FEEDSIZE 65536	// slots of the market data ring (power of two)
+#define FEEDSNAPSHOT 4096	// level changes of a book side between its snapshots
+#define ORDERVERSION 5	// order files start at a position of the input stream
+#define HISTSUB 5	// latency histograms: 2^HISTSUB linear buckets per power of two
+#define HISTSIZE ((64 - HISTSUB) << HISTSUB)
+
+// Incoming order hand-off (Prod -> Cons)
+#define INGEST_QUEUE 0	// mutex/condvar queue
+#define INGEST_RING  1	// lock-free ring, parks when idle
+#define INGEST_SPIN  2	// lock-free ring, busy-waits
+
+// Wait strategies (-y)
+#define WAIT_BLOCK 0	// block on the condition variable
+#define WAIT_YIELD 1	// give the core up and check again
+#define WAIT_SPIN  2	// spin SPINCOUNT times, then block
+#define WAIT_BUSY  3	// spin with pause, never give the core up
+
+// Engine thread roles (-P)
+#define ROLE_PROD   0	// producers
+#define ROLE_CONS   1	// consumer
+#define ROLE_BM     2	// buy market trier
+#define ROLE_SM     3	// sell market trier
+#define ROLE_BL     4	// buy limit trier
+#define ROLE_SL     5	// sell limit trier
+#define ROLE_CANCEL 6	// cancel trier
+#define NROLES 7
+#define NLOCKS 8	// kinds of engine lock: incoming, bm_q, sm_q, bl_q, sl_q, cancel_q, lock_transaction, stops
+
+// Latency stages
+#define STAGE_QUEUE 0	// producer enqueue -> Cons dispatch
+#define STAGE_ROUTE 1	// Cons dispatch -> trier pickup
+#define STAGE_MATCH 2	// trier pickup -> fill
+#define STAGE_TOTAL 3	// producer enqueue -> fill
+#define NSTAGES 4
+
+// Destinations Cons routes orders to
+#define DEST_BM 0	// buy-market queue
+#define DEST_SM 1	// sell-market queue
+#define DEST_BL 2	// buy-limit book side
+#define DEST_SL 3	// sell-limit book side
+#define DEST_CANCEL 4	// cancel queue
+#define DEST_STOP 5	// trigger table of the stop orders
+
+// Market data messages
+#define FEED_ADD 'A'	// new price level
+#define FEED_CHANGE 'C'	// volume of a price level changed
+#define FEED_DELETE 'D'	// price level emptied
+#define FEED_TRADE 'T'	// trade
+#define FEED_SNAPSHOT 'S'	// a book side follows, orders holds its number of levels
+#define FEED_LEVEL 'L'	// price level of a snapshot
+
+// Pause inside spin loops
+#if defined(__x86_64__) || defined(__i386__)
+#define cpuRelax() __builtin_ia32_pause()
+#else
+#define cpuRelax() sched_yield()
+#endif
+
+// Gateway messages (native byte order, each starts with its length)
+#define GW_ORDER 'N'	// client: new market or limit order
+#define GW_CANCEL 'C'	// client: cancel an order by its engine id
+#define GW_END 'E'	// client: end of the order stream
+#define GW_ACK 'A'	// report: order accepted, carries its engine id and the client's reference
+#define GW_FILL 'F'	// report: order (partly) filled
+#define GW_CANCELED 'X'	// report: order canceled
+#define GW_REJECT 'R'	// report: malformed request, order to cancel not found, or order turned away by a full side
 
 /******************** Structs ********************/
 
@@ -8,24 +101,457 @@
 typedef struct
  {
     long id;             // identification number
-    long oldid;          // old identification number for Cancel
-    long timestamp;      // time of order placement
+    long oldid;          // old identification number for Cancel | shares an iceberg shows, in a snapshot
+    long timestamp;      // time of order placement (ns)
+    long enqueued;       // time Prod handed it to Cons (ns)
+    long dispatched;     // time Cons routed it to its market (ns)
     int  vol;            // number of shares
     int  price;          // price limit for Limit orders
+    unsigned short symbol;   // instrument traded
     char action;         // 'B' for buy | 'S' for sell
     char type;           // 'M' for market | 'L' for limit | 'C' for cancel
+                         // 'S' for stop market | 'T' for stop limit | 'I' for iceberg (limit)
+    int  aux;            // stop price *10 of a stop order | shares an iceberg shows at a time
 } order;
 
-// The struct timeval structure represents an elapsed time
-struct timeval startwtime, endwtime;
+// Start of the run, timestamps are relative to it
+struct timespec startwtime;
+
+// Log-linear latency histogram, written by one thread only
+typedef struct
+{
+    _Atomic unsigned long count[HISTSIZE];
+    _Atomic unsigned long total, sum, max;
+} histogram;
+
+// Engine mutex, profiled with -K: the mutex comes first, so its counters are found from a pointer to it
+typedef struct
+{
+    pthread_mutex_t mut;
+    _Atomic unsigned long taken;    // acquisitions
+    _Atomic unsigned long failed;   // trylocks that found it held
+    _Atomic unsigned long waited;   // ns spent blocked taking it
+    _Atomic unsigned long maxWait;  // longest of those waits
+    _Atomic unsigned long held;     // ns it was held, waits on its conditions left out
+    long since;                     // when the holder took it
+} lockStats;
+
+// Loop passes of one engine thread (-K)
+typedef struct loopStats
+{
+    int role;                       // ROLE_*
+    int symbol;                     // market of a trier, generator of a producer, -1 for the consumer
+    _Atomic unsigned long useful;   // passes that moved orders
+    _Atomic unsigned long idle;     // passes that waited for orders or room
+    struct loopStats *next;
+} loopStats;
+
+// Add to a counter only its owner (or a lock's holder) writes
+#define statAdd(a, v) atomic_store_explicit(&(a), atomic_load_explicit(&(a), memory_order_relaxed) + (v), memory_order_relaxed)
+
+// One thread's histograms, for every stage
+typedef struct stageHist
+{
+    histogram stage[NSTAGES];
+    struct stageHist *next;
+} stageHist;
+
+// Queued or resting order, hot part: all the matching reads, four to a cache line
+typedef struct
+{
+    int  price;
+    int  vol;
+    int  id;             // low 32 bits of the order id
+    unsigned short symbol;
+    char action;
+    char type;
+} orderHot;
+
+// Queued or resting order, cold part: only read to report a fill
+typedef struct
+{
+    long id;
+    long oldid;
+    long timestamp;
+    long enqueued;
+    long dispatched;
+    int  aux;            // as in the order
+    int  hidden;         // shares of an iceberg behind the ones shown
+} orderCold;
+
+// Fill of a sweep: both orders as they were before it, reported with the rest of its batch
+typedef struct
+{
+    orderHot  ord1, ord2;
+    orderCold c1, c2;
+    int price;           // price *10
+    int vol;             // shares traded
+} tradeFill;
+
+// Links of a node in its queue or price level FIFO
+typedef struct
+{
+    int next, prev;      // neighbours (-1 if none)
+} orderLink;
+
+// Chunk of order nodes, each part in its own array
+typedef struct
+{
+    orderHot  hot[POOLCHUNK];
+    orderLink link[POOLCHUNK];
+    orderCold cold[POOLCHUNK];
+} poolChunk;
+
+// Order node pool: chunks of nodes with a free list, grown a chunk at a time
+typedef struct
+{
+    poolChunk **chunk;   // chunks never move, node n is in chunk[n >> POOLSHIFT]
+    int nchunks, maxchunks;
+    int freeNode;        // head of the free node list (-1 if none)
+    int node;            // NUMA node the chunks are placed on (-1 for where first touched)
+} orderPool;
 
-// Queue struct
+#define poolHot(p, n)  (&(p)->chunk[(n) >> POOLSHIFT]->hot[(n) & (POOLCHUNK-1)])
+#define poolLink(p, n) (&(p)->chunk[(n) >> POOLSHIFT]->link[(n) & (POOLCHUNK-1)])
+#define poolCold(p, n) (&(p)->chunk[(n) >> POOLSHIFT]->cold[(n) & (POOLCHUNK-1)])
+
+// Queue struct: FIFO of orders in pool nodes
 typedef struct
 {
-    order item[QUEUESIZE];
-    long head, tail;
+    orderPool pool;      // storage for the queued orders
+    int head, tail;      // first and last node (-1 if empty)
+    int size;
+    int capacity;        // full at this size, 0 for no limit
+    int full, empty;
+    pthread_mutex_t *mut;
+    pthread_cond_t *notFull, *notEmpty;
+} queue;
+
+// Trade record struct, as stored in trades.bin
+typedef struct
+{
+    long timestamp;      // time of the trade
+    long id1, id2;       // orders traded
+    int  price;          // trade price *10
+    int  vol;            // number of shares
+    unsigned short symbol;
+    char type1, type2;   // types of the orders traded
+} tradeRecord;
+
+// trades.bin header, followed by the records
+typedef struct
+{
+    char magic[4];       // TRADEMAGIC
+    int  version;
+    int  recordSize;     // sizeof (tradeRecord)
+    int  nsymbols;       // trace lines carry the symbol if more than one
+} tradeFileHeader;
+
+// Order file header, followed by the order records
+typedef struct
+{
+    char magic[4];       // ORDERMAGIC
+    int  version;
+    int  recordSize;     // sizeof (order)
+    int  nsymbols;       // symbols the orders are spread over
+    long offset;         // position in the input stream of the first record
+} orderFileHeader;
+
+// Order file mapped for replay
+typedef struct
+{
+    const order *item;   // records, straight from the mapping
+    long count;
+    long next;           // next record to replay
+    int  nsymbols;
+    int  paced;          // replay at the recorded timestamps
+    long start;          // time the replay started (-1 before)
+    long offset;         // position in the input stream of the first record
+} orderFile;
+
+// Snapshot file header, followed by each market's state
+typedef struct
+{
+    char magic[4];       // SNAPMAGIC
+    int  version;
+    int  recordSize;     // sizeof (order)
+    int  nsymbols;
+    long position;       // orders of the input stream taken before the snapshot
+    long nextId;         // every id below it has been taken
+} snapshotHeader;
+
+// State of one market in a snapshot, followed by its orders queue by queue:
+// buy and sell market, buy and sell limit level by level, cancels
+typedef struct
+{
+    int  price;          // currentPriceX10
+    int  orders;         // order records that follow
+} snapshotMarket;
+
+// Trade log ring slot
+typedef struct
+{
+    _Atomic unsigned long seq;   // position the slot is ready for
+    tradeRecord rec;
+} logSlot;
+
+// Trade log struct: multi-producer ring drained by the writer thread
+typedef struct
+{
+    _Atomic unsigned long tail __attribute__ ((aligned (CACHELINE)));	// next position to claim
+    unsigned long head __attribute__ ((aligned (CACHELINE)));	// next position to write out
+    _Atomic int stop;	// set once no more trades will come
+    int fd;
+    logSlot slot[LOGSIZE];
+} tradeLog;
+
+// Incoming ring slot
+typedef struct
+{
+    _Atomic unsigned long seq;   // position the slot is ready for
+    order ord;
+} ringSlot;
+
+// Multi-producer/single-consumer ring struct: the generators' hand-off to Cons
+typedef struct
+{
+    _Atomic unsigned long tail __attribute__ ((aligned (CACHELINE)));	// next position to claim
+    unsigned long head __attribute__ ((aligned (CACHELINE)));	// next position to consume
+    _Atomic int consWaiting __attribute__ ((aligned (CACHELINE)));	// consumer parked on empty
+    int park;					// park when idle instead of spinning forever
+    pthread_mutex_t *mut;
+    pthread_cond_t *notEmpty;
+    ringSlot slot[RINGSIZE] __attribute__ ((aligned (CACHELINE)));
+} mpscRing;
+
+// Write-ahead journal: orders the stream owner accepted, made durable in groups by the journal writer
+typedef struct
+{
+    unsigned long tail __attribute__ ((aligned (CACHELINE)));	// next position to append (owner)
+    unsigned long taken;	// next position to hand on to the markets (owner)
+    _Atomic unsigned long appended __attribute__ ((aligned (CACHELINE)));	// tail as published to the writer
+    _Atomic unsigned long durable;	// positions below are on disk
+    _Atomic int stop;	// set once no more orders will come
+    int fd;
+    long interval;	// us the writer lets a group grow for before it syncs it
+    long syncs;	// groups committed
+    pthread_mutex_t *mut;
+    pthread_cond_t *notEmpty, *synced;
+    order item[JOURNALSIZE] __attribute__ ((aligned (CACHELINE)));
+} journal;
+
+// Gateway request, as sent by a client
+typedef struct
+{
+    unsigned short length;   // bytes of the message, at least sizeof (gwRequest)
+    char kind;           // GW_ORDER | GW_CANCEL | GW_END
+    char action;         // 'B' for buy | 'S' for sell
+    char type;           // 'M' for market | 'L' for limit | 'S' stop market | 'T' stop limit | 'I' iceberg
+    char pad;
+    unsigned short symbol;   // instrument traded
+    int  vol;            // number of shares
+    int  price;          // price limit *10, for limit orders
+    long ref;            // client's reference, echoed in the acknowledgement
+    long id;             // engine id of the order to cancel, or the aux of a new order:
+                         // the stop price *10 of a stop order, the shares an iceberg shows
+} gwRequest;
+
+// Gateway execution report, as sent back to the client
+typedef struct
+{
+    unsigned short length;   // sizeof (gwReport)
+    char kind;           // GW_ACK | GW_FILL | GW_CANCELED | GW_REJECT
+    char pad[3];
+    unsigned short symbol;
+    int  vol;            // shares filled
+    int  price;          // fill price *10
+    long id;             // engine id of the order
+    long ref;            // client's reference, for acknowledgements and rejects
+} gwReport;
+
+// Gateway connection slot, its buffers are kept for the next connection
+typedef struct
+{
+    int fd;              // socket, -1 if the slot is free
+    int rlen, wlen;      // bytes waiting in rbuf and wbuf
+    int stalled;         // whole requests left in rbuf, the incoming queue was full
+    int dirty;           // reports added to wbuf since the last flush
+    int writing;         // waiting for EPOLLOUT
+    long first;          // first sequence of the connection, older orders are an earlier one's
+    char *rbuf, *wbuf;
+} gwConn;
+
+// Order gateway: one epoll thread serving the clients' connections
+typedef struct
+{
+    int listenFd, epollFd, wakeFd;
+    _Atomic int waiting __attribute__ ((aligned (CACHELINE)));	// gateway about to sleep in epoll_wait
+    _Atomic int stop;
+    int ended;           // a client ended the stream
+    long seq;            // orders and cancels sequenced, ids are seq * GWCONNS + slot
+    long requests, reports, conns;
+    int npend, nstalled, ndirty, nextSlot;
+    char path[108];      // Unix socket to remove at the end, if any
+    mpscRing *out;       // execution reports from the engine
+    order pend[RINGBATCH];	// parsed, not taken by the incoming queue yet
+    int stall[GWCONNS], dirty[GWCONNS];
+    gwConn conn[GWCONNS];
+} gateway;
+
+// Random number generator state (xoshiro256**)
+typedef struct
+{
+    unsigned long s[4];
+} rng;
+
+#define rotl64(x, k) (((x) << (k)) | ((x) >> (64 - (k))))
+
+// Order generator: one per producer thread
+typedef struct
+{
+    rng r;
+    int index;           // makes the ids index, index+N, index+2N... for N generators
+    long count;          // orders generated so far
+    long limit;          // orders to generate, -1 for no limit
+    order buf[RINGBATCH] __attribute__ ((aligned (CACHELINE)));	// keeps the size a multiple of the alignment
+} generator;
+
+// Market data message, as published on the feed
+typedef struct
+{
+    long timestamp;      // ns since the start of the run
+    int  price;          // price *10
+    int  vol;            // shares at the level after the change, or traded
+    int  orders;         // orders at the level after the change
+    unsigned short symbol;
+    char kind;           // FEED_ADD, FEED_CHANGE...
+    char side;           // 'B' | 'S' ('-' for trades)
+} feedMsg;
+
+// Market data ring slot
+typedef struct
+{
+    _Atomic unsigned long seq;   // position written + 1 (0 while being written)
+    feedMsg msg;
+} feedSlot;
+
+// Market data ring, in shared memory: one writer per change, any number of readers
+typedef struct
+{
+    char magic[4];       // FEEDMAGIC
+    int  version;
+    int  msgSize;        // sizeof (feedMsg)
+    int  nslots;         // FEEDSIZE
+    int  nsymbols;
+    _Atomic unsigned long head __attribute__ ((aligned (CACHELINE)));	// next position to claim
+    feedSlot slot[FEEDSIZE] __attribute__ ((aligned (CACHELINE)));
+} feedRing;
+
+// Single-producer/single-consumer ring struct
+// head and tail live on their own cache lines, next to the owner's cached copy of the other index
+typedef struct
+{
+    _Atomic unsigned long tail __attribute__ ((aligned (CACHELINE)));	// next slot to publish
+    unsigned long headCache;	// producer's last view of head
+    _Atomic unsigned long head __attribute__ ((aligned (CACHELINE)));	// next slot to consume
+    unsigned long tailCache;	// consumer's last view of tail
+    _Atomic int consWaiting __attribute__ ((aligned (CACHELINE)));	// consumer parked on empty
+    _Atomic int prodWaiting;	// producer parked on full
+    int park;					// park when idle instead of spinning forever
+    pthread_mutex_t *mut;
+    pthread_cond_t *notFull, *notEmpty;
+    order item[RINGSIZE] __attribute__ ((aligned (CACHELINE)));
+} spscRing;
+
+// Price level struct: arrival-ordered FIFO of the resting orders at one price
+typedef struct
+{
+    int head, tail;      // first and last node of the level (-1 if empty)
+    int vol;             // shares resting at the level
+    int orders;          // orders resting at the level
+} level;
+
+// Book side struct: tick-sized price levels indexed directly by price
+typedef struct
+{
+    orderPool pool;              // storage for the resting orders
+    level *lvl;                  // lvl[i] holds the orders with price base+i
+    int base, nlevels;           // price window covered by lvl
+    int best;                    // best price cursor (valid if not empty)
+    char side;                   // 'B' for bids (best = highest) | 'S' for asks (best = lowest)
+    int symbol;
+    int sinceSnapshot;           // level changes published since the last snapshot
+    int triggers;                // a trigger table: stop orders by stop price, kept off the feed
     int full, empty;
     int size;
+    int capacity;                // full at this size, 0 for no limit
     pthread_mutex_t *mut;
     pthread_cond_t *notFull, *notEmpty;
-} queue;
\ No newline at end of file
+} book;
+
+// Book sides as compile-time parameters: the functions taking a constant side
+// (and order types) are inlined into each caller, where the tests on them fold away
+#define SPECIALIZED static inline __attribute__ ((always_inline))
+#define OTHER(side) (((side) == 'B') ? 'S' : 'B')
+#define BETTER(side, p1, p2) (((side) == 'B') ? (p1) > (p2) : (p1) < (p2))	// p1 is a better price than p2 for side
+#define CROSSES(side, p1, p2) (((side) == 'B') ? (p1) >= (p2) : (p1) <= (p2))	// p1 of side trades with p2 of the other side
+#define WORSE(side) (((side) == 'B') ? -1 : 1)	// step from a price level of side to the next worse one
+
+// Vectorized loops that want more than the baseline instruction set: built once
+// per target and picked when the program loads, so the binary stays portable.
+// Not under the sanitizers, whose runtime is not up yet when the pick is made
+#if defined (__x86_64__) && defined (__GNUC__) && !defined (__SANITIZE_THREAD__) && !defined (__SANITIZE_ADDRESS__)
+#define CLONED __attribute__ ((target_clones ("avx2", "default")))
+#else
+#define CLONED
+#endif
+
+// Order index entry: where a resting order can be found
+typedef struct
+{
+    long id;             // order id (-1 for a free slot)
+    queue *q;            // market queue holding the order, or
+    book  *b;            // book side holding the order
+    int slot;            // node in the pool of q or b
+} indexEntry;
+
+// Order index struct: open addressing hash table from id to location
+typedef struct
+{
+    indexEntry *item;
+    int mask;            // slots - 1, the table doubles when half full
+    int size;
+    pthread_mutex_t *mut;
+} orderIndex;
+
+// OHLCV bar of a symbol, built up trade by trade
+typedef struct
+{
+    long start;          // start of the bar's interval (ms), -1 before the first trade
+    int  open, high, low, close;   // prices *10
+    int  trades;
+    long volume;
+    long notional;       // sum of price *10 times volume, for the VWAP
+    long buyVolume;      // volume of the trades a buy order initiated
+    long sellVolume;     // volume of the trades a sell order initiated
+} bar;
+
+// Market struct: everything one symbol trades on
+typedef struct
+{
+    int symbol;
+    queue *bm_q;         // buy-market queue
+    queue *sm_q;         // sell-market queue
+    book  *bl_q;         // buy-limit book side
+    book  *sl_q;         // sell-limit book side
+    queue *cancel_q;     // cancel queue
+    book  *bs_q;         // buy stops by stop price, lowest first
+    book  *ss_q;         // sell stops by stop price, highest first
+    queue *fired_q;      // stops set off, waiting to be routed as market or limit orders
+    orderIndex *index;   // id -> location of every resting order
+    pthread_mutex_t *lock_transaction;   // mutex used for locking a transaction
+    int auction;                         // in a call phase: orders rest without matching
+    bar bar;                             // bar being built, under the transaction lock
+    long volume, notional;               // since the start, for the running VWAP
+    _Atomic int currentPriceX10;         // current share price *10, read by the generators without a lock
+} market;
@@ -0,0 +1,54 @@
+/**********************************************************************/
+/*    StockMarket project 2013                                        */
+/*    TraceDump: converts the binary trade log (trades.bin) to the    */
+/*    text trace.txt and sharePrice.txt files                         */
+/**********************************************************************/
+
+// Includes-defines
+#include "StockMarket.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/******************** Main function ********************/
+int main(int argc, char *argv[])
+{
+    const char *path = (argc > 1) ? argv[1] : "trades.bin";
+    FILE *in, *trace_file, *sharePrice;
+    tradeFileHeader hdr;
+    tradeRecord rec;
+    char sym[16] = "";
+    long n = 0;
+    
+    in = fopen(path, "rb");
+    if (in == NULL)
+	{
+        perror(path);
+        return (1);
+    }
+    if (fread(&hdr, sizeof (hdr), 1, in) != 1 || memcmp(hdr.magic, TRADEMAGIC, 4) != 0
+        || hdr.recordSize != sizeof (tradeRecord))
+	{
+        fprintf(stderr, "%s: not a trade log of this build\n", path);
+        return (1);
+    }
+    
+    trace_file = fopen("trace.txt","wt");
+    sharePrice = fopen("sharePrice.txt","wt");
+    
+	// same formats as trace() writes with -l text
+    while (fread(&rec, sizeof (rec), 1, in) == 1)
+	{
+        if (hdr.nsymbols > 1)
+            sprintf(sym, "%04d  ", rec.symbol);
+        fprintf(sharePrice, "%s%5.1f\n", sym, (float) rec.price/10.0);
+        fprintf(trace_file,"%s%08ld  %5.1f  %4d  %08ld  %c  %08ld  %c\n", sym, rec.timestamp, (float) rec.price/10.0, rec.vol, rec.id1, rec.type1, rec.id2, rec.type2);
+        n++;
+    }
+    
+    fclose(trace_file);
+    fclose(sharePrice);
+    fclose(in);
+    printf("%ld trades\n", n);
+    return (0);
+}